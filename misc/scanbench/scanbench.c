@@ -0,0 +1,248 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * checks the kernels of neoagent/scan.c against the Boyer-Moore search
+ * which they replaced and memchr, and measures their throughput.
+ *
+ * build in this directory:
+ *
+ *   gcc -std=gnu99 -O2 -I../../neoagent $(pkg-config --cflags libev json-c) \
+ *       -o scanbench scanbench.c ../../neoagent/scan.c
+ *
+ * usage: scanbench [bufsize] [loop]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "defines.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define SCANBENCH_RDTSC
+#endif
+
+#define SCANBENCH_SKIP_SIZE  256
+#define SCANBENCH_CHECK_CNT 10000
+
+static const char *scanbench_kernel_names[NA_SCAN_KERNEL_MAX] = {
+    [NA_SCAN_KERNEL_SCALAR] = "scalar",
+    [NA_SCAN_KERNEL_SSE2]   = "sse2",
+    [NA_SCAN_KERNEL_AVX2]   = "avx2",
+};
+
+// private functions
+static void bm_create_table (const char *pattern, int *skip, size_t skip_size);
+static int bm_search (const char *haystack, const char *pattern, int *skip, int hlen, int plen);
+static void scanbench_fill (char *buf, int len);
+static uint64_t scanbench_now (void);
+static bool scanbench_check (int *skip);
+static void scanbench_run (const char *buf, int len, int loop, int *skip);
+
+/**
+ * Boyer-Moore search of neoagent before the scan kernels
+ */
+static void bm_create_table (const char *pattern, int *skip, size_t skip_size)
+{
+    int len;
+
+    for (int i=0;i<skip_size;++i) {
+        skip[i] = 0;
+    }
+
+    len = strlen(pattern);
+    for (int i=0;i<len-1;++i) {
+        skip[(int)((unsigned char)*(pattern + i))] = len - i - 1;
+    }
+}
+
+static int bm_search (const char *haystack, const char *pattern, int *skip, int hlen, int plen)
+{
+    int i, c;
+
+    i = 0;
+    c = 0;
+
+ loop:
+    while (i + plen <= hlen) {
+
+        for (int j=plen-1;j>=0;--j) {
+            if (pattern[j] != haystack[i + j]) {
+                if (skip[(int)((unsigned char)haystack[i + j])] == 0) {
+                    if (j == plen - 1) {
+                        i += plen;
+                    } else {
+                        i += plen - j - 1;
+                    }
+                } else {
+                    int s = skip[(int)((unsigned char)haystack[i + j])] - (plen - 1 - j);
+                    if (s <= 0) {
+                        ++i;
+                    } else {
+                        i += s;
+                    }
+                }
+                goto loop;
+            }
+        }
+
+        if (skip[(int)((unsigned char)haystack[i + plen - 1])] != 0) {
+            i += skip[(int)((unsigned char)haystack[i + plen - 1])];
+        } else {
+            i += plen;
+        }
+
+        ++c;
+    }
+
+    return c;
+}
+
+/**
+ * text with CR, LF and spaces in it like memcached requests.
+ */
+static void scanbench_fill (char *buf, int len)
+{
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789 \r\n";
+
+    for (int i=0;i<len;++i) {
+        buf[i] = chars[rand() % (sizeof(chars) - 1)];
+    }
+}
+
+static uint64_t scanbench_now (void)
+{
+#ifdef SCANBENCH_RDTSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/**
+ * every kernel agrees with bm_search and memchr at any length and alignment.
+ */
+static bool scanbench_check (int *skip)
+{
+    int off, len, crlf;
+    char buf[4096 + 64];
+    const char *p;
+
+    for (int k=0;k<NA_SCAN_KERNEL_MAX;++k) {
+        if (!na_scan_kernel_set(k)) {
+            continue;
+        }
+        for (int n=0;n<SCANBENCH_CHECK_CNT;++n) {
+            off = rand() % 64;
+            len = rand() % 4096;
+            scanbench_fill(buf + off, len);
+            crlf = bm_search(buf + off, "\r\n", skip, len, 2);
+            if (na_scan_count_crlf(buf + off, len) != crlf) {
+                printf("%s: na_scan_count_crlf differs from bm_search(off:%d, len:%d)\n", scanbench_kernel_names[k], off, len);
+                return false;
+            }
+            p = memchr(buf + off, ' ', len);
+            if (na_scan_byte(buf + off, len, ' ') != p) {
+                printf("%s: na_scan_byte differs from memchr(off:%d, len:%d)\n", scanbench_kernel_names[k], off, len);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static void scanbench_run (const char *buf, int len, int loop, int *skip)
+{
+    uint64_t begin, end;
+    volatile int c;
+    const char * volatile p;
+
+#ifdef SCANBENCH_RDTSC
+    const char *unit = "bytes/cycle";
+#else
+    const char *unit = "bytes/ns";
+#endif
+
+    begin = scanbench_now();
+    for (int i=0;i<loop;++i) {
+        c = bm_search(buf, "\r\n", skip, len, 2);
+    }
+    end = scanbench_now();
+    printf("%-8s count_crlf %8.3f %s\n", "bm", (double)len * loop / (end - begin), unit);
+
+    begin = scanbench_now();
+    for (int i=0;i<loop;++i) {
+        p = memchr(buf, '\n', len);
+    }
+    end = scanbench_now();
+    printf("%-8s scan_byte  %8.3f %s\n", "memchr", (double)len * loop / (end - begin), unit);
+
+    for (int k=0;k<NA_SCAN_KERNEL_MAX;++k) {
+        if (!na_scan_kernel_set(k)) {
+            continue;
+        }
+
+        begin = scanbench_now();
+        for (int i=0;i<loop;++i) {
+            c = na_scan_count_crlf(buf, len);
+        }
+        end = scanbench_now();
+        printf("%-8s count_crlf %8.3f %s\n", scanbench_kernel_names[k], (double)len * loop / (end - begin), unit);
+
+        begin = scanbench_now();
+        for (int i=0;i<loop;++i) {
+            p = na_scan_byte(buf, len, '\n');
+        }
+        end = scanbench_now();
+        printf("%-8s scan_byte  %8.3f %s\n", scanbench_kernel_names[k], (double)len * loop / (end - begin), unit);
+    }
+
+    (void)c;
+    (void)p;
+}
+
+int main (int argc, char *argv[])
+{
+    int len, loop;
+    int skip[SCANBENCH_SKIP_SIZE];
+    char *buf;
+
+    len  = argc > 1 ? atoi(argv[1]) : 16384;
+    loop = argc > 2 ? atoi(argv[2]) : 10000;
+    if (len <= 0 || loop <= 0) {
+        fprintf(stderr, "usage: %s [bufsize] [loop]\n", argv[0]);
+        return 1;
+    }
+
+    srand(time(NULL));
+    bm_create_table("\r\n", skip, SCANBENCH_SKIP_SIZE);
+
+    if (!scanbench_check(skip)) {
+        return 1;
+    }
+    printf("all kernels agree with bm_search and memchr\n");
+
+    // a buffer without the byte is scanned through, the worst case of a request
+    buf = malloc(len);
+    if (buf == NULL) {
+        return 1;
+    }
+    memset(buf, 'a', len);
+    scanbench_run(buf, len, loop, skip);
+    free(buf);
+
+    return 0;
+}
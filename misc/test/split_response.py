@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+
+#
+# runs neoagent in front of fake memcached servers which write every
+# response in small pieces and checks that each client gets its whole
+# response. the cases are the settings which batch gets on the framed path
+# and noreply sets whose errors are answered late.
+#
+# usage: split_response.py [path of neoagent]
+#
+
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+CHUNK_SIZE    = 3     # bytes of a write of the fake servers
+CHUNK_DELAY   = 0.002 # seconds between the writes
+ERROR_DELAY   = 0.05  # seconds before the error of a noreply set
+CLIENT_CNT    = 16
+REQUEST_CNT   = 20
+TIMEOUT       = 5.0
+ERROR_REPLY   = b'SERVER_ERROR out of memory storing object\r\n'
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def value_of(key):
+    return ('val-%s' % key).encode()
+
+
+class FakeMemcached(threading.Thread):
+    """get, set and delete of the text protocol and mn. a key never set has value_of(key).
+    a set of a key beginning with error fails late even with noreply."""
+
+    def __init__(self):
+        threading.Thread.__init__(self, daemon=True)
+        self.store = {}
+        self.lock  = threading.Lock()
+        self.sock  = socket.socket()
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('127.0.0.1', 0))
+        self.sock.listen(128)
+        self.port  = self.sock.getsockname()[1]
+
+    def run(self):
+        while True:
+            conn, _ = self.sock.accept()
+            threading.Thread(target=self.serve, args=(conn,), daemon=True).start()
+
+    def send_split(self, conn, res):
+        for i in range(0, len(res), CHUNK_SIZE):
+            conn.sendall(res[i:i + CHUNK_SIZE])
+            time.sleep(CHUNK_DELAY)
+
+    def serve(self, conn):
+        buf = b''
+        try:
+            while True:
+                while b'\r\n' not in buf:
+                    data = conn.recv(4096)
+                    if not data:
+                        return
+                    buf += data
+                line, buf = buf.split(b'\r\n', 1)
+                tokens = line.split()
+                if not tokens:
+                    continue
+                cmd = tokens[0]
+                if cmd in (b'get', b'gets'):
+                    res = b''
+                    for key in tokens[1:]:
+                        with self.lock:
+                            val = self.store.get(key, value_of(key.decode()))
+                        res += b'VALUE %s 0 %d\r\n%s\r\n' % (key, len(val), val)
+                    self.send_split(conn, res + b'END\r\n')
+                elif cmd == b'set':
+                    size = int(tokens[4])
+                    while len(buf) < size + 2:
+                        data = conn.recv(4096)
+                        if not data:
+                            return
+                        buf += data
+                    data = buf[:size]
+                    buf  = buf[size + 2:]
+                    if tokens[1].startswith(b'error'):
+                        time.sleep(ERROR_DELAY)
+                        self.send_split(conn, ERROR_REPLY)
+                        continue
+                    with self.lock:
+                        self.store[tokens[1]] = data
+                    if tokens[-1] != b'noreply':
+                        self.send_split(conn, b'STORED\r\n')
+                elif cmd == b'delete':
+                    with self.lock:
+                        self.store.pop(tokens[1], None)
+                    if tokens[-1] != b'noreply':
+                        self.send_split(conn, b'DELETED\r\n')
+                elif cmd == b'mn':
+                    self.send_split(conn, b'MN\r\n')
+                else:
+                    self.send_split(conn, b'ERROR\r\n')
+        except OSError:
+            pass
+        finally:
+            conn.close()
+
+
+def wait_port(port):
+    limit = time.time() + TIMEOUT
+    while time.time() < limit:
+        try:
+            socket.create_connection(('127.0.0.1', port), 0.1).close()
+            return True
+        except OSError:
+            time.sleep(0.05)
+    return False
+
+
+def recv_response(sock, expected):
+    buf = b''
+    while len(buf) < len(expected):
+        data = sock.recv(4096)
+        if not data:
+            break
+        buf += data
+    return buf
+
+
+def get_response(key):
+    val = value_of(key)
+    return b'VALUE %s 0 %d\r\n%s\r\nEND\r\n' % (key.encode(), len(val), val)
+
+
+def client_get(sock, idx, n):
+    key = 'key%d' % ((idx + n) % 8)
+    sock.sendall(b'get %s\r\n' % key.encode())
+    return get_response(key)
+
+
+def client_noreply_get(sock, idx, n):
+    """the get is forwarded before the error of the noreply set arrives."""
+    key = 'key%d' % ((idx + n) % 8)
+    sock.sendall(b'set error%d 0 0 1 noreply\r\nx\r\n' % idx)
+    time.sleep(ERROR_DELAY / 5)
+    sock.sendall(b'get %s\r\n' % key.encode())
+    return get_response(key)
+
+
+def client_noreply_pipelined(sock, idx, n):
+    """the error of the noreply set goes before the response of the get."""
+    key = 'key%d' % ((idx + n) % 8)
+    sock.sendall(b'set error%d 0 0 1 noreply\r\nx\r\nget %s\r\n' % (idx, key.encode()))
+    return ERROR_REPLY + get_response(key)
+
+
+def client(port, idx, request, errors):
+    try:
+        sock = socket.create_connection(('127.0.0.1', port), TIMEOUT)
+        sock.settimeout(TIMEOUT)
+        for n in range(REQUEST_CNT):
+            expected = request(sock, idx, n)
+            res      = recv_response(sock, expected)
+            if res != expected:
+                errors.append('client %d: %r for %r' % (idx, res, expected))
+                break
+        sock.close()
+    except OSError as e:
+        errors.append('client %d: %s' % (idx, e))
+
+
+CASES = [
+    ('batch', 1, {'batch_window_usec': 2000}, client_get),
+    ('batch + pipelining', 1, {'pipelining': True, 'batch_window_usec': 2000}, client_get),
+    ('batch + target servers', 2, {'batch_window_usec': 2000}, client_get),
+    ('collapsing + pipelining', 1, {'pipelining': True, 'request_collapsing': True}, client_get),
+    ('late noreply error', 1, {}, client_noreply_get),
+    ('late noreply error + pipelining', 1, {'pipelining': True}, client_noreply_pipelined),
+]
+
+
+def run_case(neoagent, tmpdir, name, server_cnt, params, request):
+    servers = [FakeMemcached() for i in range(server_cnt)]
+    for s in servers:
+        s.start()
+
+    port = free_port()
+    env  = {
+        'name':          'split',
+        'port':          port,
+        'target_server': ['127.0.0.1:%d' % s.port for s in servers] if server_cnt > 1 else '127.0.0.1:%d' % servers[0].port,
+        'stport':        free_port(),
+        'stsockpath':    os.path.join(tmpdir, 'neoagent_st.sock'),
+        'worker_max':    2,
+        'connpool_max':  4,
+    }
+    env.update(params)
+    conf = {
+        'ctl': {
+            'sockpath': os.path.join(tmpdir, 'neoagent_ctl.sock'),
+            'logpath':  os.path.join(tmpdir, 'neoagent_ctl.log'),
+        },
+        'environments': [env],
+    }
+    confpath = os.path.join(tmpdir, 'split.json')
+    with open(confpath, 'w') as f:
+        json.dump(conf, f)
+
+    proc = subprocess.Popen([neoagent, '-f', confpath], start_new_session=True)
+    try:
+        if not wait_port(port):
+            return ['neoagent does not listen on %d' % port]
+        errors  = []
+        clients = [threading.Thread(target=client, args=(port, i, request, errors)) for i in range(CLIENT_CNT)]
+        for c in clients:
+            c.start()
+        for c in clients:
+            c.join()
+        return errors
+    finally:
+        os.killpg(proc.pid, signal.SIGKILL)
+        proc.wait()
+
+
+def main():
+    here     = os.path.dirname(os.path.abspath(__file__))
+    neoagent = sys.argv[1] if len(sys.argv) > 1 else os.path.join(here, '../../neoagent/neoagent')
+
+    failed = 0
+    with tempfile.TemporaryDirectory() as tmpdir:
+        for name, server_cnt, params, request in CASES:
+            errors = run_case(neoagent, tmpdir, name, server_cnt, params, request)
+            print('%-32s %s' % (name, 'ok' if not errors else 'NG'))
+            for e in errors[:4]:
+                print('    ' + e)
+            if errors:
+                failed += 1
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
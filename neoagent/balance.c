@@ -0,0 +1,124 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "defines.h"
+
+/**
+ * requests are balanced over target_servers which are replicas of each other(replica_balancing).
+ * two servers are picked at random and the request goes to the one with lower load,
+ * which is the peak-EWMA of the latency times the requests in flight.
+ * the EWMA jumps to a latency above it at once and decays toward lower ones
+ * with the weight tau / (tau + elapsed), which approximates exp(-elapsed / tau).
+ */
+
+static const uint64_t NA_BALANCE_DECAY_USEC = 10000000; // tau
+static const uint64_t NA_BALANCE_IDLE_USEC  = 100000000;
+
+// private functions
+static uint64_t na_balance_now (void);
+static uint64_t na_balance_decay (uint64_t ewma, uint64_t elapsed);
+static uint64_t na_balance_cost (na_connpool_t *connpool, uint64_t now);
+
+static uint64_t na_balance_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t na_balance_decay (uint64_t ewma, uint64_t elapsed)
+{
+    // long idle time decays it to nothing and keeps the product in 64 bits
+    if (elapsed >= NA_BALANCE_IDLE_USEC) {
+        return 0;
+    }
+    return ewma * NA_BALANCE_DECAY_USEC / (NA_BALANCE_DECAY_USEC + elapsed);
+}
+
+static uint64_t na_balance_cost (na_connpool_t *connpool, uint64_t now)
+{
+    uint64_t ewma, stamp;
+    int inflight;
+
+    ewma     = atomic_load_explicit(&connpool->ewma_usec,  memory_order_relaxed);
+    stamp    = atomic_load_explicit(&connpool->ewma_stamp, memory_order_relaxed);
+    inflight = atomic_load_explicit(&connpool->inflight,   memory_order_relaxed);
+    if (now > stamp) {
+        ewma = na_balance_decay(ewma, now - stamp);
+    }
+
+    // a server without latency yet is still ordered by its requests in flight
+    return (ewma + 1) * (inflight + 1);
+}
+
+/**
+ * index of target_servers with lower load of two picked at random(power of two choices).
+ */
+int na_balance_node (na_env_t *env)
+{
+    int a, b;
+    uint64_t now;
+
+    if (env->target_server_cnt <= 1) {
+        return 0;
+    }
+
+    a = rand() % env->target_server_cnt;
+    b = rand() % (env->target_server_cnt - 1);
+    if (b >= a) {
+        ++b;
+    }
+
+    now = na_balance_now();
+    if (na_balance_cost(na_connpool_node(env, b), now) < na_balance_cost(na_connpool_node(env, a), now)) {
+        return b;
+    }
+
+    return a;
+}
+
+uint64_t na_balance_start (na_connpool_t *connpool)
+{
+    atomic_fetch_add_explicit(&connpool->inflight, 1, memory_order_relaxed);
+    return na_balance_now();
+}
+
+/**
+ * the latency is not sampled when no response is expected or the request fails.
+ * concurrent samples of a server may overwrite each other, which only loses a sample.
+ */
+void na_balance_end (na_connpool_t *connpool, uint64_t begin, bool is_sample)
+{
+    uint64_t now, rtt, ewma, stamp;
+
+    atomic_fetch_sub_explicit(&connpool->inflight, 1, memory_order_relaxed);
+
+    if (!is_sample) {
+        return;
+    }
+
+    now   = na_balance_now();
+    rtt   = now > begin ? now - begin : 0;
+    ewma  = atomic_load_explicit(&connpool->ewma_usec,  memory_order_relaxed);
+    stamp = atomic_load_explicit(&connpool->ewma_stamp, memory_order_relaxed);
+
+    if (rtt > ewma) {
+        ewma = rtt;
+    } else if (now > stamp) {
+        // the weight of the old value decays with the time since the last sample
+        ewma = rtt + na_balance_decay(ewma - rtt, now - stamp);
+    }
+
+    atomic_store_explicit(&connpool->ewma_usec,  ewma, memory_order_relaxed);
+    atomic_store_explicit(&connpool->ewma_stamp, now,  memory_order_relaxed);
+}
@@ -0,0 +1,220 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * gets of a single key which clients of a worker send within
+ * batch_window_usec are merged into one multi-key get of the leader.
+ * the merged request is built in twbuf of the leader and the VALUE blocks
+ * of its response are split back to the clients by the key.
+ */
+
+static const int NA_BATCH_BUFSIZE_MIN = 1024;
+
+// private functions
+static bool na_batch_append (char **buf, int *bufsize, int *cap, const char *data, int size);
+static bool na_batch_response_add (na_client_t *client, const char *data, int size);
+static bool na_batch_response_value (na_client_t *leader, const char *key, int keylen, const char *data, int size);
+static bool na_batch_response_copy (na_client_t *leader);
+static bool na_batch_is_key_merged (na_client_t *leader, na_client_t *client);
+
+/**
+ * cap is the usable size of buf, which is allocated with a byte for NUL.
+ */
+static bool na_batch_append (char **buf, int *bufsize, int *cap, const char *data, int size)
+{
+    int es;
+    char *b;
+
+    if (*bufsize + size > *cap) {
+        es = *cap > 0 ? *cap : NA_BATCH_BUFSIZE_MIN;
+        while (es < *bufsize + size) {
+            es *= 2;
+        }
+        b = (char *)realloc(*buf, es + 1);
+        if (b == NULL) {
+            return false;
+        }
+        *buf = b;
+        *cap = es;
+    }
+
+    memcpy(*buf + *bufsize, data, size);
+    *bufsize += size;
+
+    return true;
+}
+
+/**
+ * the response of the leader is built in twbuf because srbuf is being split.
+ */
+static bool na_batch_response_add (na_client_t *client, const char *data, int size)
+{
+    if (client->is_batch_leader) {
+        return na_batch_append(&client->twbuf, &client->twbufsize, &client->translate_bufsize, data, size);
+    }
+    return na_batch_append(&client->srbuf, &client->srbufsize, &client->response_bufsize, data, size);
+}
+
+static bool na_batch_response_value (na_client_t *leader, const char *key, int keylen, const char *data, int size)
+{
+    for (na_client_t *c=leader;c!=NULL;c=c->batch_next) {
+        if (strlen(c->get_key) == keylen && memcmp(c->get_key, key, keylen) == 0 &&
+            !na_batch_response_add(c, data, size))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * the response is not VALUE blocks(e.g. SERVER_ERROR),
+ * every client of the batch gets it as it is.
+ */
+static bool na_batch_response_copy (na_client_t *leader)
+{
+    for (na_client_t *c=leader->batch_next;c!=NULL;c=c->batch_next) {
+        c->srbufsize = 0;
+        if (!na_batch_append(&c->srbuf, &c->srbufsize, &c->response_bufsize, leader->srbuf, leader->srbufsize)) {
+            return false;
+        }
+        c->srbuf[c->srbufsize] = '\0';
+    }
+    return true;
+}
+
+static bool na_batch_is_key_merged (na_client_t *leader, na_client_t *client)
+{
+    for (na_client_t *c=leader;c!=client;c=c->batch_next) {
+        if (strcmp(c->get_key, client->get_key) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * build the multi-key get of the leader and the clients of batch_next in twbuf.
+ * the same key is requested once.
+ */
+bool na_batch_request (na_client_t *leader)
+{
+    leader->twbufsize = 0;
+
+    if (!na_batch_append(&leader->twbuf, &leader->twbufsize, &leader->translate_bufsize, "get", 3)) {
+        return false;
+    }
+
+    for (na_client_t *c=leader;c!=NULL;c=c->batch_next) {
+        if (na_batch_is_key_merged(leader, c)) {
+            continue;
+        }
+        if (!na_batch_append(&leader->twbuf, &leader->twbufsize, &leader->translate_bufsize, " ", 1) ||
+            !na_batch_append(&leader->twbuf, &leader->twbufsize, &leader->translate_bufsize, c->get_key, strlen(c->get_key)))
+        {
+            return false;
+        }
+    }
+
+    return na_batch_append(&leader->twbuf, &leader->twbufsize, &leader->translate_bufsize, "\r\n", 2);
+}
+
+/**
+ * split the response in srbuf of the leader into srbuf of each client of the batch.
+ */
+bool na_batch_response (na_client_t *leader)
+{
+    const char *p, *end, *nl, *key, *sp;
+    char *ep;
+    int keylen, size;
+    long bytes;
+
+    leader->twbufsize = 0;
+    for (na_client_t *c=leader->batch_next;c!=NULL;c=c->batch_next) {
+        c->srbufsize = 0;
+    }
+
+    p   = leader->srbuf;
+    end = leader->srbuf + leader->srbufsize;
+    for (;;) {
+        nl = na_scan_byte(p, end - p, '\n');
+        if (nl == NULL) {
+            return false;
+        }
+        if (nl - p == 4 && memcmp(p, "END\r", 4) == 0) {
+            break;
+        }
+        if (nl - p < 6 || memcmp(p, "VALUE ", 6) != 0) {
+            return na_batch_response_copy(leader);
+        }
+
+        // VALUE <key> <flags> <bytes> [<cas unique>]
+        key = p + 6;
+        sp  = na_scan_byte(key, nl - key, ' ');
+        if (sp == NULL) {
+            return false;
+        }
+        keylen = sp - key;
+        sp     = na_scan_byte(sp + 1, nl - sp - 1, ' ');
+        if (sp == NULL) {
+            return false;
+        }
+        bytes = strtol(sp + 1, &ep, 10);
+        if (ep == sp + 1 || bytes < 0 || bytes > end - nl) {
+            return false;
+        }
+        size = nl - p + 1 + bytes + 2;
+        if (size > end - p) {
+            return false;
+        }
+        if (!na_batch_response_value(leader, key, keylen, p, size)) {
+            return false;
+        }
+        p += size;
+    }
+
+    for (na_client_t *c=leader;c!=NULL;c=c->batch_next) {
+        if (!na_batch_response_add(c, "END\r\n", 5)) {
+            return false;
+        }
+        if (c != leader) {
+            c->srbuf[c->srbufsize] = '\0';
+        }
+    }
+
+    if (leader->twbufsize > leader->response_bufsize) {
+        leader->srbuf            = (char *)realloc(leader->srbuf, leader->twbufsize + 1);
+        leader->response_bufsize = leader->twbufsize;
+    }
+    memcpy(leader->srbuf, leader->twbuf, leader->twbufsize);
+    leader->srbufsize                = leader->twbufsize;
+    leader->srbuf[leader->srbufsize] = '\0';
+
+    return true;
+}
+
+/**
+ * bucket of the batch histogram for cnt keys.
+ */
+int na_batch_hist_index (int cnt)
+{
+    int idx;
+
+    if (cnt <= 1) {
+        return 0;
+    }
+
+    idx = 32 - __builtin_clz((unsigned int)(cnt - 1));
+
+    return idx < NA_BATCH_HIST_MAX ? idx : NA_BATCH_HIST_MAX - 1;
+}
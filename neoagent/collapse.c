@@ -0,0 +1,78 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * in-flight gets of each worker keyed by the key.
+ * a client which gets the key fetched by other client of the worker
+ * waits for the response of the leader instead of sending its own request.
+ * the table is touched only by the thread of the worker.
+ */
+
+void na_collapse_init (na_event_worker_t *worker)
+{
+    worker->inflight_ents = (fnv_ent_t *)calloc(sizeof(fnv_ent_t), FNV_TBL_CNT_DEFAULT);
+    worker->inflight      = fnv_tbl_create(worker->inflight_ents, FNV_TBL_CNT_DEFAULT);
+    atomic_init(&worker->collapse_cnt,       0);
+    atomic_init(&worker->collapse_fetch_cnt, 0);
+}
+
+void na_collapse_destroy (na_event_worker_t *worker)
+{
+    fnv_tbl_destroy(worker->inflight);
+    NA_FREE(worker->inflight_ents);
+    worker->inflight = NULL;
+}
+
+/**
+ * returns the leader fetching get_key of client or NULL.
+ * the client is queued to the leader when there is,
+ * otherwise it is registered as the leader.
+ */
+na_client_t *na_collapse_join (na_event_worker_t *worker, na_client_t *client)
+{
+    na_client_t *leader;
+    size_t len;
+
+    len    = strlen(client->get_key);
+    leader = (na_client_t *)fnv_get(worker->inflight, client->get_key, len);
+
+    if (leader == NULL) {
+        if (fnv_put(worker->inflight, client->get_key, client, len, sizeof(na_client_t *)) != FNV_PUT_SUCCESS) {
+            return NULL;
+        }
+        client->is_collapse_leader = true;
+        client->collapse_next      = NULL;
+        return NULL;
+    }
+
+    client->collapse_next = leader->collapse_next;
+    leader->collapse_next = client;
+
+    return leader;
+}
+
+/**
+ * unregister the leader and returns the list of its waiters.
+ */
+na_client_t *na_collapse_leave (na_event_worker_t *worker, na_client_t *leader)
+{
+    na_client_t *waiters;
+
+    fnv_out(worker->inflight, leader->get_key, strlen(leader->get_key));
+
+    waiters                    = leader->collapse_next;
+    leader->collapse_next      = NULL;
+    leader->is_collapse_leader = false;
+
+    return waiters;
+}
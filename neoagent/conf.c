@@ -47,6 +47,22 @@ typedef enum na_param_t {
     NA_PARAM_SLOW_QUERY_LOG_FORMAT,
     NA_PARAM_SLOW_QUERY_LOG_ACCESS_MASK,
     NA_PARAM_TRY_MAX,
+    NA_PARAM_REUSEPORT,
+    NA_PARAM_REUSEPORT_CBPF,
+    NA_PARAM_WORK_STEALING,
+    NA_PARAM_ACCEPT_BATCH_MAX,
+    NA_PARAM_CPU_AFFINITY,
+    NA_PARAM_NUMA_NODE,
+    NA_PARAM_PERSISTENT_WATCHER,
+    NA_PARAM_RESPONSE_STREAMING,
+    NA_PARAM_REQUEST_STREAMING,
+    NA_PARAM_PIPELINING,
+    NA_PARAM_UPSTREAM_PROTOCOL,
+    NA_PARAM_REQUEST_COLLAPSING,
+    NA_PARAM_BATCH_WINDOW_USEC,
+    NA_PARAM_BATCH_KEY_MAX,
+    NA_PARAM_HEDGE_DELAY_USEC,
+    NA_PARAM_REPLICA_BALANCING,
     NA_PARAM_MAX // Always add new codes to the end before this one
 } na_param_t;
 
@@ -89,7 +105,23 @@ const char *na_params[NA_PARAM_MAX] = {
     [NA_PARAM_SLOW_QUERY_LOG_PATH]        = "slow_query_log_path",
     [NA_PARAM_SLOW_QUERY_LOG_FORMAT]      = "slow_query_log_format",
     [NA_PARAM_SLOW_QUERY_LOG_ACCESS_MASK] = "slow_query_log_access_mask",
-    [NA_PARAM_TRY_MAX]                    = "try_max"
+    [NA_PARAM_TRY_MAX]                    = "try_max",
+    [NA_PARAM_REUSEPORT]                  = "reuseport",
+    [NA_PARAM_REUSEPORT_CBPF]             = "reuseport_cbpf",
+    [NA_PARAM_WORK_STEALING]              = "work_stealing",
+    [NA_PARAM_ACCEPT_BATCH_MAX]           = "accept_batch_max",
+    [NA_PARAM_CPU_AFFINITY]               = "cpu_affinity",
+    [NA_PARAM_NUMA_NODE]                  = "numa_node",
+    [NA_PARAM_PERSISTENT_WATCHER]         = "persistent_watcher",
+    [NA_PARAM_RESPONSE_STREAMING]         = "response_streaming",
+    [NA_PARAM_REQUEST_STREAMING]          = "request_streaming",
+    [NA_PARAM_PIPELINING]                 = "pipelining",
+    [NA_PARAM_UPSTREAM_PROTOCOL]          = "upstream_protocol",
+    [NA_PARAM_REQUEST_COLLAPSING]         = "request_collapsing",
+    [NA_PARAM_BATCH_WINDOW_USEC]          = "batch_window_usec",
+    [NA_PARAM_BATCH_KEY_MAX]              = "batch_key_max",
+    [NA_PARAM_HEDGE_DELAY_USEC]           = "hedge_delay_usec",
+    [NA_PARAM_REPLICA_BALANCING]          = "replica_balancing"
 };
 
 static const char *na_event_models[NA_EVENT_MODEL_MAX] = {
@@ -97,6 +129,13 @@ static const char *na_event_models[NA_EVENT_MODEL_MAX] = {
     [NA_EVENT_MODEL_EPOLL]  = "epoll",
     [NA_EVENT_MODEL_KQUEUE] = "kqueue",
     [NA_EVENT_MODEL_AUTO]   = "auto",
+    [NA_EVENT_MODEL_IOURING] = "io_uring",
+};
+
+static const char *na_upstream_protocols[NA_UPSTREAM_PROTOCOL_MAX] = {
+    [NA_UPSTREAM_PROTOCOL_TEXT]   = "text",
+    [NA_UPSTREAM_PROTOCOL_META]   = "meta",
+    [NA_UPSTREAM_PROTOCOL_BINARY] = "binary",
 };
 
 static const char *na_log_formats[NA_LOG_FORMAT_MAX] = {
@@ -107,6 +146,9 @@ static const char *na_log_formats[NA_LOG_FORMAT_MAX] = {
 static const char *na_ctl_param_name (na_ctl_param_t param);
 static const char *na_param_name (na_param_t param);
 static na_event_model_t na_detect_event_model (const char *model_str);
+static na_upstream_protocol_t na_detect_upstream_protocol (const char *protocol_str);
+static void na_conf_server_set (na_server_t *server, const char *host_str, int weight);
+static void na_conf_target_servers_init (struct json_object *servers_obj, na_env_t *na_env);
 
 static const char *na_ctl_param_name (na_ctl_param_t param)
 {
@@ -129,12 +171,29 @@ static na_event_model_t na_detect_event_model (const char *model_str)
         model = NA_EVENT_MODEL_KQUEUE;
     } else if (strcmp(model_str, na_event_models[NA_EVENT_MODEL_AUTO]) == 0) {
         model = NA_EVENT_MODEL_AUTO;
+    } else if (strcmp(model_str, na_event_models[NA_EVENT_MODEL_IOURING]) == 0) {
+        model = NA_EVENT_MODEL_IOURING;
     } else {
         model = NA_EVENT_MODEL_UNKNOWN;
     }
     return model;
 }
 
+static na_upstream_protocol_t na_detect_upstream_protocol (const char *protocol_str)
+{
+    na_upstream_protocol_t protocol;
+    if (strcmp(protocol_str, na_upstream_protocols[NA_UPSTREAM_PROTOCOL_TEXT]) == 0) {
+        protocol = NA_UPSTREAM_PROTOCOL_TEXT;
+    } else if (strcmp(protocol_str, na_upstream_protocols[NA_UPSTREAM_PROTOCOL_META]) == 0) {
+        protocol = NA_UPSTREAM_PROTOCOL_META;
+    } else if (strcmp(protocol_str, na_upstream_protocols[NA_UPSTREAM_PROTOCOL_BINARY]) == 0) {
+        protocol = NA_UPSTREAM_PROTOCOL_BINARY;
+    } else {
+        protocol = NA_UPSTREAM_PROTOCOL_UNKNOWN;
+    }
+    return protocol;
+}
+
 static na_log_format_t na_detect_log_format (const char *format_str)
 {
     na_log_format_t format;
@@ -148,11 +207,70 @@ static na_log_format_t na_detect_log_format (const char *format_str)
     return format;
 }
 
+static void na_conf_server_set (na_server_t *server, const char *host_str, int weight)
+{
+    char host_buf[NA_HOSTNAME_MAX + 1];
+    na_host_t host;
+
+    strncpy(host_buf, host_str, NA_HOSTNAME_MAX);
+    host_buf[NA_HOSTNAME_MAX] = '\0';
+    host = na_create_host(host_buf);
+    memcpy(&server->host, &host, sizeof(host));
+    na_set_sockaddr(&host, &server->addr);
+    server->weight = weight;
+}
+
+/**
+ * each target server is "host:port" or {"server":"host:port", "weight":n}.
+ */
+static void na_conf_target_servers_init (struct json_object *servers_obj, na_env_t *na_env)
+{
+    int cnt, weight;
+    struct json_object *server_obj, *host_obj, *weight_obj;
+
+    cnt = json_object_array_length(servers_obj);
+    if (cnt <= 0 || cnt > NA_TARGET_SERVER_MAX) {
+        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+    }
+
+    for (int i=0;i<cnt;++i) {
+        server_obj = json_object_array_get_idx(servers_obj, i);
+        if (json_object_is_type(server_obj, json_type_string)) {
+            na_conf_server_set(&na_env->target_servers[i], json_object_get_string(server_obj), 1);
+            continue;
+        }
+        NA_PARAM_TYPE_CHECK(server_obj, json_type_object);
+        host_obj   = json_object_object_get(server_obj, "server");
+        weight_obj = json_object_object_get(server_obj, "weight");
+        if (host_obj == NULL) {
+            NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+        }
+        NA_PARAM_TYPE_CHECK(host_obj, json_type_string);
+        weight = 1;
+        if (weight_obj != NULL) {
+            NA_PARAM_TYPE_CHECK(weight_obj, json_type_int);
+            weight = json_object_get_int(weight_obj);
+            if (weight <= 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+        }
+        na_conf_server_set(&na_env->target_servers[i], json_object_get_string(host_obj), weight);
+    }
+
+    na_env->target_server     = na_env->target_servers[0];
+    na_env->target_server_cnt = cnt;
+}
+
 const char *na_event_model_name (na_event_model_t model)
 {
     return na_event_models[model];
 }
 
+const char *na_upstream_protocol_name (na_upstream_protocol_t protocol)
+{
+    return na_upstream_protocols[protocol];
+}
+
 const char *na_log_format_name (na_log_format_t format)
 {
     return na_log_formats[format];
@@ -357,11 +475,18 @@ void na_conf_env_init(struct json_object *environments_obj, na_env_t *na_env, in
             strncpy(na_env->fssockpath, json_object_get_string(param_obj), NA_PATH_MAX);
             break;
         case NA_PARAM_TARGET_SERVER:
+            if (json_object_is_type(param_obj, json_type_array)) {
+                na_conf_target_servers_init(param_obj, na_env);
+                break;
+            }
             NA_PARAM_TYPE_CHECK(param_obj, json_type_string);
             strncpy(host_buf, json_object_get_string(param_obj), NA_HOSTNAME_MAX);
             host = na_create_host(host_buf);
             memcpy(&na_env->target_server.host, &host, sizeof(host));
             na_set_sockaddr(&host, &na_env->target_server.addr);
+            na_env->target_server.weight = 1;
+            na_env->target_servers[0]    = na_env->target_server;
+            na_env->target_server_cnt    = 1;
             break;
         case NA_PARAM_BACKUP_SERVER:
             NA_PARAM_TYPE_CHECK(param_obj, json_type_string);
@@ -421,6 +546,85 @@ void na_conf_env_init(struct json_object *environments_obj, na_env_t *na_env, in
             NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
             na_env->try_max = json_object_get_int(param_obj);
             break;
+        case NA_PARAM_REUSEPORT:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_reuseport = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_REUSEPORT_CBPF:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_reuseport_cbpf = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_WORK_STEALING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_work_stealing = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_ACCEPT_BATCH_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->accept_batch_max = json_object_get_int(param_obj);
+            if (na_env->accept_batch_max <= 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_CPU_AFFINITY:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_string);
+            strncpy(na_env->cpu_affinity, json_object_get_string(param_obj), NA_CPULIST_MAX);
+            break;
+        case NA_PARAM_NUMA_NODE:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->numa_node = json_object_get_int(param_obj);
+            break;
+        case NA_PARAM_PERSISTENT_WATCHER:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_persistent_watcher = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_RESPONSE_STREAMING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_response_streaming = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_REQUEST_STREAMING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_request_streaming = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_PIPELINING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_pipelining = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_UPSTREAM_PROTOCOL:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_string);
+            na_env->upstream_protocol = na_detect_upstream_protocol(json_object_get_string(param_obj));
+            if (na_env->upstream_protocol == NA_UPSTREAM_PROTOCOL_UNKNOWN) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_REQUEST_COLLAPSING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_request_collapsing = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_BATCH_WINDOW_USEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->batch_window_usec = json_object_get_int(param_obj);
+            if (na_env->batch_window_usec < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_BATCH_KEY_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->batch_key_max = json_object_get_int(param_obj);
+            if (na_env->batch_key_max <= 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_HEDGE_DELAY_USEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->hedge_delay_usec = json_object_get_int(param_obj);
+            if (na_env->hedge_delay_usec < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_REPLICA_BALANCING:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_replica_balancing = json_object_get_boolean(param_obj);
+            break;
         default:
             // no through
             assert(false);
@@ -433,6 +637,16 @@ void na_conf_env_init(struct json_object *environments_obj, na_env_t *na_env, in
         na_log_open(na_env);
     }
 
+    // keys are distributed over target servers instead of failing over
+    if (na_env->target_server_cnt > 1 && na_env->is_use_backup) {
+        NA_ERROR_OUTPUT(na_env, "backup_server is ignored with multiple target servers");
+        na_env->is_use_backup = false;
+    }
+    if (na_env->target_server_cnt <= 1 && na_env->is_replica_balancing) {
+        NA_ERROR_OUTPUT(na_env, "replica_balancing is ignored with a single target server");
+        na_env->is_replica_balancing = false;
+    }
+
     // open slow query log, if enabled
     if (((na_env->slow_query_sec.tv_sec  != 0)  ||
          (na_env->slow_query_sec.tv_nsec != 0))) {
@@ -13,6 +13,8 @@
 
 // private functions
 static void na_connpool_deactivate (na_connpool_t *connpool);
+static void na_connpool_open (na_env_t *env, na_connpool_t *connpool);
+static bool na_connpool_assign_unlocked (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server);
 
 static void na_connpool_deactivate (na_connpool_t *connpool)
 {
@@ -28,12 +30,26 @@ static void na_connpool_deactivate (na_connpool_t *connpool)
     }
 }
 
+static void na_connpool_open (na_env_t *env, na_connpool_t *connpool)
+{
+    for (int i=0;i<env->connpool_max;++i) {
+        connpool->fd_pool[i] = na_target_server_tcpsock_init();
+        na_target_server_tcpsock_setup(connpool->fd_pool[i], true);
+        if (connpool->fd_pool[i] <= 0) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+        }
+    }
+}
+
 void na_connpool_create (na_connpool_t *connpool, int c)
 {
     connpool->fd_pool  = calloc(sizeof(int), c);
     connpool->mark     = calloc(sizeof(int), c);
     connpool->active   = calloc(sizeof(int), c);
     connpool->max      = c;
+    atomic_init(&connpool->inflight,   0);
+    atomic_init(&connpool->ewma_usec,  0);
+    atomic_init(&connpool->ewma_stamp, 0);
 }
 
 void na_connpool_destroy (na_connpool_t *connpool)
@@ -57,26 +73,21 @@ void na_connpool_assign_internal (na_env_t *env, na_connpool_t *connpool, int i,
     *cur = i;
 }
 
-bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server)
+static bool na_connpool_assign_unlocked (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server)
 {
     int ri;
 
-    pthread_mutex_lock(&env->lock_connpool);
-
     ri = rand() % env->connpool_max;
     if (connpool->mark[ri] == 0) {
         na_connpool_assign_internal(env, connpool, ri, cur, fd, server);
-        pthread_mutex_unlock(&env->lock_connpool);
         return true;
     }
 
-
     switch (rand() % 2) {
     case 0:
         for (int i=env->connpool_max-1;i>=0;--i) {
             if (connpool->mark[i] == 0) {
                 na_connpool_assign_internal(env, connpool, i, cur, fd, server);
-                pthread_mutex_unlock(&env->lock_connpool);
                 return true;
             }
         }
@@ -85,25 +96,50 @@ bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *
         for (int i=0;i<env->connpool_max;++i) {
             if (connpool->mark[i] == 0) {
                 na_connpool_assign_internal(env, connpool, i, cur, fd, server);
-                pthread_mutex_unlock(&env->lock_connpool);
                 return true;
             }
         }
         break;
     }
-    pthread_mutex_unlock(&env->lock_connpool);
     return false;
 }
 
-void na_connpool_init (na_env_t *env)
+bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server)
 {
-    for (int i=0;i<env->connpool_max;++i) {
-        env->connpool_active.fd_pool[i] = na_target_server_tcpsock_init();
-        na_target_server_tcpsock_setup(env->connpool_active.fd_pool[i], true);
-        if (env->connpool_active.fd_pool[i] <= 0) {
-            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+    bool is_assigned;
+
+    pthread_mutex_lock(&env->lock_connpool);
+    is_assigned = na_connpool_assign_unlocked(env, connpool, cur, fd, server);
+    pthread_mutex_unlock(&env->lock_connpool);
+
+    return is_assigned;
+}
+
+/**
+ * lease up to n pooled connections with a single lock acquisition.
+ * returns the number of leased connections.
+ */
+int na_connpool_assign_batch (na_env_t *env, na_connpool_t *connpool, int n, int *curs, int *fds, na_server_t *server)
+{
+    int cnt;
+
+    pthread_mutex_lock(&env->lock_connpool);
+    for (cnt=0;cnt<n;++cnt) {
+        if (!na_connpool_assign_unlocked(env, connpool, &curs[cnt], &fds[cnt], server)) {
+            break;
         }
     }
+    pthread_mutex_unlock(&env->lock_connpool);
+
+    return cnt;
+}
+
+void na_connpool_init (na_env_t *env)
+{
+    na_connpool_open(env, &env->connpool_active);
+    for (int i=1;i<env->target_server_cnt;++i) {
+        na_connpool_open(env, &env->connpool_nodes[i]);
+    }
 }
 
 na_connpool_t *na_connpool_select(na_env_t *env)
@@ -114,6 +150,17 @@ na_connpool_t *na_connpool_select(na_env_t *env)
     return &env->connpool_active;
 }
 
+/**
+ * connpool of target_servers[node]. the first one follows the health check.
+ */
+na_connpool_t *na_connpool_node (na_env_t *env, int node)
+{
+    if (node == 0) {
+        return na_connpool_select(env);
+    }
+    return &env->connpool_nodes[node];
+}
+
 void na_connpool_switch (na_env_t *env)
 {
     na_connpool_t *connpool;
@@ -125,11 +172,5 @@ void na_connpool_switch (na_env_t *env)
         connpool = &env->connpool_active;
     }
 
-    for (int i=0;i<env->connpool_max;++i) {
-        connpool->fd_pool[i] = na_target_server_tcpsock_init();
-        na_target_server_tcpsock_setup(connpool->fd_pool[i], true);
-        if (connpool->fd_pool[i] <= 0) {
-            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
-        }
-    }
+    na_connpool_open(env, connpool);
 }
@@ -0,0 +1,135 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "defines.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+static const char *NA_NUMA_NODE_CPULIST_PATH = "/sys/devices/system/node/node%d/cpulist";
+
+/**
+ * parse a cpu list such as "0-3,8,10-11".
+ */
+bool na_cpuset_parse (const char *cpulist, cpu_set_t *set)
+{
+    const char *p;
+    char *e;
+    long first, last;
+
+    CPU_ZERO(set);
+
+    p = cpulist;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == ',' || *p == '\n') {
+            ++p;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        errno = 0;
+        first = strtol(p, &e, 10);
+        if (e == p || errno != 0 || first < 0) {
+            return false;
+        }
+        last = first;
+        p    = e;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &e, 10);
+            if (e == p || errno != 0 || last < first) {
+                return false;
+            }
+            p = e;
+        }
+        if (last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (long cpu=first;cpu<=last;++cpu) {
+            CPU_SET(cpu, set);
+        }
+        if (*p != ',' && *p != '\n' && *p != '\0') {
+            return false;
+        }
+    }
+
+    return CPU_COUNT(set) > 0;
+}
+
+bool na_numa_node_cpuset (int node, cpu_set_t *set)
+{
+    FILE *fp;
+    char path[NA_PATH_MAX + 1];
+    char cpulist[BUFSIZ];
+
+    snprintf(path, NA_PATH_MAX, NA_NUMA_NODE_CPULIST_PATH, node);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return false;
+    }
+    if (fgets(cpulist, sizeof(cpulist), fp) == NULL) {
+        fclose(fp);
+        return false;
+    }
+    fclose(fp);
+
+    return na_cpuset_parse(cpulist, set);
+}
+
+/**
+ * prefer memory of the node for the calling thread.
+ * threads created after this inherit the policy.
+ */
+bool na_numa_node_bind (int node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    unsigned long nodemask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+
+    if (node < 0 || node >= CPU_SETSIZE) {
+        return false;
+    }
+    memset(nodemask, 0, sizeof(nodemask));
+    nodemask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask, sizeof(nodemask) * 8) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * n-th cpu of the set, wrapping around.
+ */
+int na_cpuset_nth (cpu_set_t *set, int n)
+{
+    int cnt, idx;
+
+    cnt = CPU_COUNT(set);
+    if (cnt == 0) {
+        return -1;
+    }
+    idx = n % cnt;
+
+    for (int cpu=0;cpu<CPU_SETSIZE;++cpu) {
+        if (CPU_ISSET(cpu, set)) {
+            if (idx-- == 0) {
+                return cpu;
+            }
+        }
+    }
+
+    return -1;
+}
@@ -11,8 +11,11 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
@@ -30,7 +33,11 @@
 #define NA_HOSTNAME_MAX     256
 #define NA_NAME_MAX          64
 #define NA_PATH_MAX         256
-#define NA_BM_SKIP_SIZE     256
+#define NA_CACHELINE_SIZE    64
+#define NA_CPULIST_MAX      256
+#define NA_KEY_MAX          250
+#define NA_BATCH_HIST_MAX     8
+#define NA_TARGET_SERVER_MAX 32
 
 /**
  * time
@@ -54,12 +61,14 @@ void na_target_server_tcpsock_setup (int tsfd, bool is_keepalive);
 void na_target_server_hcsock_setup (int tsfd);
 void na_set_sockaddr (na_host_t *host, struct sockaddr_in *addr);
 na_host_t na_create_host(char *host);
-int na_front_server_tcpsock_init (uint16_t port, int conn_max);
+int na_front_server_tcpsock_init (uint16_t port, int conn_max, bool is_reuseport);
+bool na_front_server_reuseport_cbpf_attach (int fsfd, int group_size);
 int na_front_server_unixsock_init (char *sockpath, mode_t mask, int conn_max);
 int na_stat_server_unixsock_init (char *sockpath, mode_t mask);
 int na_stat_server_tcpsock_init (uint16_t port);
 bool na_server_connect (int tsfd, struct sockaddr_in *tsaddr);
 int na_server_accept (int sfd);
+int na_server_accept_batch (int sfd, int *cfds, int max);
 
 /**
  * memproto
@@ -72,15 +81,65 @@ typedef enum na_memproto_cmd_t {
     NA_MEMPROTO_CMD_ADD,
     NA_MEMPROTO_CMD_DELETE,
     NA_MEMPROTO_CMD_QUIT,
+    NA_MEMPROTO_CMD_BINARY,
+    NA_MEMPROTO_CMD_META,
     NA_MEMPROTO_CMD_UNKNOWN,
     NA_MEMPROTO_CMD_NOT_DETECTED,
     NA_MEMPROTO_CMD_MAX // Always add new codes to the end before this one
 } na_memproto_cmd_t;
 
-void na_memproto_bm_skip_init (void);
 na_memproto_cmd_t na_memproto_detect_command (char *buf);
+typedef enum na_memproto_parse_state_t {
+    NA_MEMPROTO_PARSE_STATE_LINE,
+    NA_MEMPROTO_PARSE_STATE_DATA,
+    NA_MEMPROTO_PARSE_STATE_DATA_CR,
+    NA_MEMPROTO_PARSE_STATE_DATA_LF,
+    NA_MEMPROTO_PARSE_STATE_ERROR,
+    NA_MEMPROTO_PARSE_STATE_MAX // Always add new codes to the end before this one
+} na_memproto_parse_state_t;
+
+typedef enum na_memproto_res_kind_t {
+    NA_MEMPROTO_RES_KIND_LINE,   // a single line(STORED, DELETED, number, ...)
+    NA_MEMPROTO_RES_KIND_VALUES, // VALUE lines terminated by END
+    NA_MEMPROTO_RES_KIND_PACKET, // a binary packet which is not quiet
+    NA_MEMPROTO_RES_KIND_META,   // a line of meta command(HD, EN, ...) or VA with a data block
+    NA_MEMPROTO_RES_KIND_MAX // Always add new codes to the end before this one
+} na_memproto_res_kind_t;
+
+#define NA_MEMPROTO_PIPELINE_MAX 64
+#define NA_MEMPROTO_BIN_HEADER_SIZE 24
+
+typedef struct na_memproto_res_parser_t {
+    na_memproto_parse_state_t state;
+    int offset;    // bytes already parsed
+    int line;      // start of the current line
+    size_t remain; // bytes left in the current data block
+    int value_cnt;
+    int end_cnt;
+    int kind_cnt;  // 0 means responses of get only
+    int opcode;    // opcode of the current binary packet
+    bool is_barrier; // a private noop(binary) or mn(meta) terminates the requests
+    bool is_value_end; // the current data block terminates a response
+    bool is_meta;      // every response is a response of meta commands
+    na_memproto_res_kind_t kinds[NA_MEMPROTO_PIPELINE_MAX];
+} na_memproto_res_parser_t;
+
 int na_memproto_count_request_get(char *buf, int bufsize);
-int na_memproto_count_response_get(char *buf, int bufsize);
+void na_memproto_res_parser_init (na_memproto_res_parser_t *parser);
+int na_memproto_res_parse (na_memproto_res_parser_t *parser, const char *buf, int bufsize);
+void na_memproto_res_parser_shift (na_memproto_res_parser_t *parser, int n);
+int na_memproto_res_parser_keep (na_memproto_res_parser_t *parser);
+long na_memproto_storage_request_size (const char *buf, int bufsize);
+void na_memproto_res_parser_expect (na_memproto_res_parser_t *parser, na_memproto_cmd_t cmd, const char *buf, int bufsize);
+bool na_memproto_request_is_noreply (const char *buf, int bufsize);
+int na_memproto_frame_requests (na_memproto_res_parser_t *parser, const char *buf, int bufsize);
+int na_memproto_bin_frame_requests (na_memproto_res_parser_t *parser, const char *buf, int bufsize);
+int na_memproto_bin_res_parse (na_memproto_res_parser_t *parser, const char *buf, int bufsize);
+const char *na_memproto_barrier (na_memproto_cmd_t cmd, int *size);
+bool na_memproto_barrier_strip (na_memproto_cmd_t cmd, const char *buf, int *bufsize);
+int na_memproto_noreply_skip (const char *buf, int bufsize, int *mn_cnt, int *match, int *error_cnt);
+bool na_memproto_get_key (const char *buf, int bufsize, char *key);
+int na_memproto_request_key (na_memproto_cmd_t cmd, const char *buf, int bufsize, const char **key, int *keylen);
 
 /**
  * env
@@ -91,6 +150,9 @@ typedef enum na_event_state_t {
     NA_EVENT_STATE_TARGET_READ,
     NA_EVENT_STATE_TARGET_WRITE,
     NA_EVENT_STATE_COMPLETE,
+    NA_EVENT_STATE_COLLAPSED, // waits for the response of the same get of other client
+    NA_EVENT_STATE_BATCHED,   // waits for the multi-key get of the batch
+    NA_EVENT_STATE_FANOUT,    // waits for the gets of the keys to each target server
     NA_EVENT_STATE_MAX // Always add new codes to the end before this one
 } na_event_state_t;
 
@@ -99,10 +161,19 @@ typedef enum na_event_model_t {
     NA_EVENT_MODEL_EPOLL,
     NA_EVENT_MODEL_KQUEUE,
     NA_EVENT_MODEL_AUTO,
+    NA_EVENT_MODEL_IOURING,
     NA_EVENT_MODEL_UNKNOWN,
     NA_EVENT_MODEL_MAX // Always add new codes to the end before this one
 } na_event_model_t;
 
+typedef enum na_upstream_protocol_t {
+    NA_UPSTREAM_PROTOCOL_TEXT,
+    NA_UPSTREAM_PROTOCOL_META,
+    NA_UPSTREAM_PROTOCOL_BINARY,
+    NA_UPSTREAM_PROTOCOL_UNKNOWN,
+    NA_UPSTREAM_PROTOCOL_MAX // Always add new codes to the end before this one
+} na_upstream_protocol_t;
+
 typedef enum na_log_format_t {
     NA_LOG_FORMAT_PLAIN,
     NA_LOG_FORMAT_JSON,
@@ -113,13 +184,22 @@ typedef enum na_log_format_t {
 typedef struct na_server_t {
     na_host_t host;
     struct sockaddr_in addr;
+    int weight;
 } na_server_t;
 
+typedef struct na_ketama_point_t {
+    uint32_t value;
+    int node; // index of target_servers
+} na_ketama_point_t;
+
 typedef struct na_connpool_t {
     int *fd_pool;
     int *mark;
     int *active;
     int max;
+    _Atomic int inflight;         // requests sent to the server and not answered yet
+    _Atomic uint64_t ewma_usec;   // peak-EWMA of the latency of the server
+    _Atomic uint64_t ewma_stamp;  // time of the last latency sample in microseconds
 } na_connpool_t;
 
 typedef struct na_ctl_env_t {
@@ -136,6 +216,11 @@ typedef struct na_ctl_env_t {
     pthread_mutex_t lock_restart;
 } na_ctl_env_t;
 
+typedef struct na_busy_word_t {
+    _Atomic uint64_t bits;
+    char pad[NA_CACHELINE_SIZE - sizeof(uint64_t)];
+} na_busy_word_t;
+
 typedef struct na_env_t {
     char name[NA_NAME_MAX + 1];
     int fsfd;
@@ -146,30 +231,54 @@ typedef struct na_env_t {
     char fssockpath[NA_PATH_MAX + 1];
     char stsockpath[NA_PATH_MAX + 1];
     mode_t access_mask;
-    na_server_t target_server;
+    na_server_t target_server; // the first one of target_servers
+    na_server_t target_servers[NA_TARGET_SERVER_MAX];
+    int target_server_cnt;
+    na_ketama_point_t *ketama;
+    int ketama_cnt;
     na_server_t backup_server;
-    int current_conn;
-    int current_conn_max;
+    char pad_conn[NA_CACHELINE_SIZE];
+    _Atomic int current_conn;
+    _Atomic int current_conn_max;
+    char pad_conn_end[NA_CACHELINE_SIZE];
     int request_bufsize;
     int response_bufsize;
     ev_io fs_watcher;
     bool is_use_backup;
+    bool is_reuseport;
+    bool is_reuseport_cbpf;
+    bool is_work_stealing;
+    bool is_persistent_watcher;
+    bool is_response_streaming;
+    bool is_request_streaming;
+    bool is_pipelining;
+    na_upstream_protocol_t upstream_protocol;
+    bool is_request_collapsing;
+    bool is_replica_balancing;
+    int batch_window_usec;
+    int batch_key_max;
+    int hedge_delay_usec;
     bool is_refused_active;
-    bool is_refused_accept;
-    bool *is_worker_busy;
+    na_busy_word_t *worker_busy_map;
     na_connpool_t connpool_active;
     na_connpool_t connpool_backup;
+    na_connpool_t *connpool_nodes; // connpool of each target server but the first one using connpool_active
     pthread_mutex_t lock_connpool;
     pthread_mutex_t lock_current_conn;
-    pthread_mutex_t lock_tid;
     pthread_mutex_t lock_loop;
-    pthread_rwlock_t lock_refused;
-    pthread_rwlock_t *lock_worker_busy;
+    _Atomic(struct na_topology_t *) topology;
+    _Atomic uint64_t topology_epoch;
+    _Atomic uint64_t acceptor_epoch;
+    struct na_topology_t *topology_retired;
+    struct na_event_worker_t *workers;
     na_event_model_t event_model;
     int worker_max;
     int conn_max;
     int connpool_max;
     int client_pool_max;
+    int accept_batch_max;
+    char cpu_affinity[NA_CPULIST_MAX + 1];
+    int numa_node;
     int loop_max;
     int try_max;
     struct timespec slow_query_sec;
@@ -188,21 +297,43 @@ typedef struct na_client_t {
     char *crbuf;
     char *srbuf;
     int crbufsize;
+    int crframed;
     int cwbufsize;
     int srbufsize;
     int swbufsize;
     int request_bufsize;
     int response_bufsize;
+    char *twbuf;           // requests or responses translated for upstream_protocol
+    int twbufsize;
+    int translate_bufsize;
+    bool is_translated;
+    bool is_noreply;         // no response is expected for the forwarded requests
+    int noreply_mn_cnt;      // MN of the barriers after noreply requests not received yet
+    int noreply_match;       // bytes of MN matched at the head of the line of the replies
+    char get_key[NA_KEY_MAX + 1];       // key of a get of a single key
+    bool is_collapse_leader;
+    struct na_client_t *collapse_next;  // clients waiting for the response of the leader
+    bool is_batch_leader;
+    struct na_client_t *batch_next;     // clients whose keys are merged into the get of the leader
+    struct na_fanout_t *fanout;         // multi-key get split by target server
+    struct na_fanout_leg_t *hedge;      // the same get sent to backup_server
+    ev_timer hedge_timer;
     na_memproto_cmd_t cmd;
-    bool is_refused_active;
+    uint64_t topology_epoch;
     bool is_use_connpool;
     bool is_use_client_pool;
     bool is_used;
     na_env_t *env;
     na_event_state_t event_state;
     na_connpool_t *connpool;
+    int node; // index of target_servers which tsfd is connected to
+    na_connpool_t *balance_connpool;    // the request is counted in flight of its server
+    uint64_t balance_begin;
+    struct na_event_worker_t *worker;
     int req_cnt;
     int res_cnt;
+    long req_remain;
+    na_memproto_res_parser_t res_parser;
     int loop_cnt;
     int cur_pool;
     ev_io c_watcher;
@@ -228,6 +359,7 @@ void na_connpool_destroy (na_connpool_t *connpool);
  */
 const char *na_event_model_name (na_event_model_t model);
 const char *na_log_format_name (na_log_format_t format);
+const char *na_upstream_protocol_name (na_upstream_protocol_t protocol);
 struct json_object *na_get_conf (na_ctl_env_t *ctl_env, const char *conf_file_json);
 struct json_object *na_get_ctl(struct json_object *conf_obj);
 struct json_object *na_get_environments(struct json_object *conf_obj, int *env_cnt);
@@ -266,6 +398,7 @@ typedef enum na_error_t {
     NA_ERROR_INVALID_CTL_CMD,
     NA_ERROR_FAILED_EXECUTE_CTM_CMD,
     NA_ERROR_UNKNOWN,
+    NA_ERROR_INVALID_RESPONSE,
     NA_ERROR_MAX // Always add new codes to the end before this one
 } na_error_t;
 
@@ -329,13 +462,144 @@ void na_ctl_die_with_error(na_ctl_env_t *env, na_error_t na_error, na_error_info
 /**
  * event
  */
+typedef struct na_event_worker_t {
+    int id;
+    na_env_t *env;
+    struct ev_loop *loop;
+    ev_async async_watcher;
+    int fsfd;
+    ev_io fs_watcher;
+    struct na_event_queue_t *queue;
+    struct na_event_deque_t *deque;
+    ev_prepare prepare_watcher;
+    ev_check check_watcher;
+    ev_tstamp busy_time;
+    ev_tstamp idle_time;
+    ev_tstamp poll_begin;
+    ev_tstamp poll_end;
+    int cpu;
+    int thief;
+    bool is_thief_kicked;
+    int conn_cnt;
+    _Atomic int load;
+    _Atomic uint64_t steal_cnt;
+    _Atomic uint64_t donate_cnt;
+    _Atomic uint64_t topology_epoch;
+    fnv_tbl_t *inflight;       // in-flight gets keyed by the key
+    fnv_ent_t *inflight_ents;
+    _Atomic uint64_t collapse_cnt;       // gets answered by the fetch of other client
+    _Atomic uint64_t collapse_fetch_cnt; // fetches shared with other clients
+    ev_timer batch_timer;
+    struct na_client_t **batch; // gets waiting for the window to close
+    int batch_cnt;
+    _Atomic uint64_t batch_hist[NA_BATCH_HIST_MAX]; // batches by number of keys(1, 2, 3-4, ..., 65-)
+    _Atomic uint64_t noreply_cnt;       // forwarded requests whose responses are not waited for
+    _Atomic uint64_t noreply_error_cnt; // discarded replies to noreply requests
+    _Atomic uint64_t fanout_hist[NA_BATCH_HIST_MAX]; // split gets by number of target servers
+    _Atomic uint64_t fanout_dedup_cnt;  // duplicate keys of split gets requested once
+    _Atomic uint64_t hedge_cnt;         // gets sent to backup_server after hedge_delay_usec
+    _Atomic uint64_t hedge_win_cnt;     // hedged gets answered by backup_server first
+} na_event_worker_t;
+
 void *na_event_loop (void *args);
+bool na_is_worker_busy (na_env_t *env, int tid);
+
+/**
+ * collapse
+ */
+void na_collapse_init (na_event_worker_t *worker);
+void na_collapse_destroy (na_event_worker_t *worker);
+na_client_t *na_collapse_join (na_event_worker_t *worker, na_client_t *client);
+na_client_t *na_collapse_leave (na_event_worker_t *worker, na_client_t *leader);
+
+/**
+ * batch
+ */
+bool na_batch_request (na_client_t *leader);
+bool na_batch_response (na_client_t *leader);
+int na_batch_hist_index (int cnt);
+
+/**
+ * ketama
+ */
+bool na_ketama_build (na_env_t *env);
+int na_ketama_node (na_env_t *env, const char *key, int keylen);
+
+/**
+ * balance
+ */
+int na_balance_node (na_env_t *env);
+uint64_t na_balance_start (na_connpool_t *connpool);
+void na_balance_end (na_connpool_t *connpool, uint64_t begin, bool is_sample);
 
 /**
- * bm
+ * fanout
  */
-void na_bm_create_table (char *pattern, int *skip, size_t skip_size);
-int na_bm_search (char *haystack, char *pattern, int *skip, int hlen, int plen);
+typedef struct na_fanout_key_t {
+    int offset;    // offset of the key in the request
+    int keylen;
+    uint32_t hash;
+    int leg;
+    int first;     // index of the first same key
+    int value;     // offset of the VALUE block in rbuf of the leg or -1
+    int valuesize;
+} na_fanout_key_t;
+
+typedef struct na_fanout_leg_t {
+    int node;      // index of target_servers
+    int fd;
+    int cur_pool;
+    na_connpool_t *connpool;
+    char *wbuf;    // get of the keys of the node
+    int wbufsize;
+    int wbufcap;
+    int swbufsize;
+    char *rbuf;
+    int rbufsize;
+    int rbufcap;
+    na_memproto_res_parser_t res_parser;
+    ev_io watcher;
+    struct na_client_t *client;
+} na_fanout_leg_t;
+
+typedef struct na_fanout_t {
+    na_fanout_key_t *keys;
+    int key_cnt;
+    int dup_cnt;
+    na_fanout_leg_t *legs;
+    int leg_cnt;
+    int done_cnt;
+} na_fanout_t;
+
+bool na_fanout_is_spread (na_env_t *env, const char *buf, int bufsize);
+na_fanout_t *na_fanout_create (na_env_t *env, const char *buf, int bufsize);
+void na_fanout_destroy (na_fanout_t *fanout);
+na_fanout_leg_t *na_fanout_leg_create (const char *buf, int bufsize);
+void na_fanout_leg_destroy (na_fanout_leg_t *leg);
+bool na_fanout_rbuf_reserve (na_fanout_leg_t *leg);
+bool na_fanout_response (na_fanout_t *fanout, const char *buf, char **res, int *ressize, int *rescap);
+
+/**
+ * scan
+ */
+typedef enum na_scan_kernel_t {
+    NA_SCAN_KERNEL_SCALAR,
+    NA_SCAN_KERNEL_SSE2,
+    NA_SCAN_KERNEL_AVX2,
+    NA_SCAN_KERNEL_MAX // Always add new codes to the end before this one
+} na_scan_kernel_t;
+
+void na_scan_init (void);
+bool na_scan_kernel_set (na_scan_kernel_t kernel);
+const char *na_scan_kernel_name (void);
+int na_scan_count_crlf (const char *buf, int len);
+const char *na_scan_byte (const char *buf, int len, char c);
+
+/**
+ * translate
+ */
+int na_translate_request (na_client_t *client, na_upstream_protocol_t protocol);
+bool na_translate_response (na_client_t *client, na_upstream_protocol_t protocol);
 
 /**
  * connpool
@@ -343,27 +607,57 @@ int na_bm_search (char *haystack, char *pattern, int *skip, int hlen, int plen);
 void na_connpool_create (na_connpool_t *connpool, int c);
 void na_connpool_destroy (na_connpool_t *connpool);
 bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server);
+int na_connpool_assign_batch (na_env_t *env, na_connpool_t *connpool, int n, int *curs, int *fds, na_server_t *server);
 void na_connpool_init (na_env_t *env);
 na_connpool_t *na_connpool_select(na_env_t *env);
+na_connpool_t *na_connpool_node (na_env_t *env, int node);
 void na_connpool_switch (na_env_t *env);
 
 /**
  * queue
  */
+typedef struct na_event_queue_cell_t {
+    _Atomic size_t seq;
+    na_client_t *client;
+    uint64_t enqueued;
+} na_event_queue_cell_t;
+
 typedef struct na_event_queue_t {
-    na_client_t **queue;
-    size_t top;
-    size_t bot;
-    size_t cnt;
+    na_event_queue_cell_t *cells;
     size_t max;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    size_t mask;
+    char pad_enqueue[NA_CACHELINE_SIZE];
+    _Atomic size_t enqueue_pos;
+    char pad_dequeue[NA_CACHELINE_SIZE];
+    _Atomic size_t dequeue_pos;
+    char pad_stat[NA_CACHELINE_SIZE];
+    _Atomic uint64_t overflow_cnt;
+    _Atomic uint64_t pop_cnt;
+    _Atomic uint64_t wait_nsec_sum;
+    _Atomic uint64_t wait_nsec_max;
 } na_event_queue_t;
 
 na_event_queue_t *na_event_queue_create(int c);
 void na_event_queue_destroy(na_event_queue_t *q);
 bool na_event_queue_push(na_event_queue_t *q, na_client_t *e);
 na_client_t *na_event_queue_pop(na_event_queue_t *q);
+size_t na_event_queue_depth(na_event_queue_t *q);
+
+typedef struct na_event_deque_t {
+    _Atomic(na_client_t *) *cells;
+    size_t max;
+    size_t mask;
+    char pad_top[NA_CACHELINE_SIZE];
+    _Atomic long top;
+    char pad_bottom[NA_CACHELINE_SIZE];
+    _Atomic long bottom;
+} na_event_deque_t;
+
+na_event_deque_t *na_event_deque_create(int c);
+void na_event_deque_destroy(na_event_deque_t *d);
+bool na_event_deque_push(na_event_deque_t *d, na_client_t *e);
+na_client_t *na_event_deque_pop(na_event_deque_t *d);
+na_client_t *na_event_deque_steal(na_event_deque_t *d);
 
 /**
  * ctl
@@ -419,6 +713,34 @@ void na_setup_ignore_signals (void);
 void na_setup_signals_for_master(sigset_t *ss);
 void na_setup_signals_for_worker(sigset_t *ss);
 
+/**
+ * topology
+ */
+typedef struct na_topology_t {
+    uint64_t epoch;
+    bool is_refused_active;
+    bool is_refused_accept;
+    na_server_t *server;
+    na_connpool_t *connpool;
+    struct na_topology_t *next;
+} na_topology_t;
+
+void na_topology_init (na_env_t *env);
+void na_topology_publish (na_env_t *env, bool is_refused_accept);
+void na_topology_reclaim (na_env_t *env);
+void na_topology_destroy (na_env_t *env);
+na_topology_t *na_topology_current (na_env_t *env);
+void na_topology_reader_online (na_env_t *env, _Atomic uint64_t *epoch);
+void na_topology_reader_offline (_Atomic uint64_t *epoch);
+
+/**
+ * cpu
+ */
+bool na_cpuset_parse (const char *cpulist, cpu_set_t *set);
+bool na_numa_node_cpuset (int node, cpu_set_t *set);
+bool na_numa_node_bind (int node);
+int na_cpuset_nth (cpu_set_t *set, int n);
+
 /**
  * util
  */
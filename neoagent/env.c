@@ -21,6 +21,9 @@ static const int  NA_ACCESS_MASK_DEFAULT      = 0664;
 static const int  NA_BUFSIZE_DEFAULT          = 65536;
 static const int  NA_WORKER_MAX_DEFAULT       = 1;
 static const int  NA_TRY_MAX_DEFAULT          = 3;
+static const int  NA_ACCEPT_BATCH_MAX_DEFAULT = 16;
+static const int  NA_NUMA_NODE_DEFAULT        = -1;
+static const int  NA_BATCH_KEY_MAX_DEFAULT    = 16;
 
 void na_ctl_env_setup_default(na_ctl_env_t *ctl_env)
 {
@@ -39,13 +42,35 @@ void na_env_setup_default(na_env_t *env, int idx)
     host                         = na_create_host(target_server_s);
     memcpy(&env->target_server.host, &host, sizeof(host));
     na_set_sockaddr(&host, &env->target_server.addr);
+    env->target_server.weight    = 1;
+    env->target_servers[0]       = env->target_server;
+    env->target_server_cnt       = 1;
+    env->ketama                  = NULL;
+    env->ketama_cnt              = 0;
+    env->connpool_nodes          = NULL;
     env->stport                  = NA_STPORT_DEFAULT + idx;
     env->worker_max              = NA_WORKER_MAX_DEFAULT;
     env->conn_max                = NA_CONN_MAX_DEFAULT;
     env->connpool_max            = NA_CONNPOOL_MAX_DEFAULT;
     env->client_pool_max         = NA_CLIENT_POOL_MAX_DEFAULT;
     env->try_max                 = NA_TRY_MAX_DEFAULT;
+    env->accept_batch_max        = NA_ACCEPT_BATCH_MAX_DEFAULT;
+    env->cpu_affinity[0]         = '\0';
+    env->numa_node               = NA_NUMA_NODE_DEFAULT;
     env->is_use_backup           = false;
+    env->is_reuseport            = false;
+    env->is_reuseport_cbpf       = false;
+    env->is_work_stealing        = false;
+    env->is_persistent_watcher   = false;
+    env->is_response_streaming   = false;
+    env->is_request_streaming    = false;
+    env->is_pipelining           = false;
+    env->upstream_protocol       = NA_UPSTREAM_PROTOCOL_TEXT;
+    env->is_request_collapsing   = false;
+    env->is_replica_balancing    = false;
+    env->batch_window_usec       = 0;
+    env->batch_key_max           = NA_BATCH_KEY_MAX_DEFAULT;
+    env->hedge_delay_usec        = 0;
     env->request_bufsize         = NA_BUFSIZE_DEFAULT;
     env->response_bufsize        = NA_BUFSIZE_DEFAULT;
     memset(&env->slow_query_sec, 0, sizeof(struct timespec));
@@ -58,25 +83,27 @@ void na_env_setup_default(na_env_t *env, int idx)
 
 void na_env_init(na_env_t *env)
 {
-    env->current_conn      = 0;
+    atomic_init(&env->current_conn,     0);
+    atomic_init(&env->current_conn_max, 0);
     env->is_refused_active = false;
-    env->is_refused_accept = false;
-    env->is_worker_busy    = calloc(sizeof(bool), env->worker_max);
-    for (int j=0;j<env->worker_max;++j) {
-        env->is_worker_busy[j] = false;
+    env->worker_busy_map   = calloc(sizeof(na_busy_word_t), (env->worker_max + 63) / 64);
+    for (int j=0;j<(env->worker_max + 63) / 64;++j) {
+        atomic_init(&env->worker_busy_map[j].bits, 0);
     }
-    env->current_conn_max = 0;
     pthread_mutex_init(&env->lock_connpool,     NULL);
     pthread_mutex_init(&env->lock_current_conn, NULL);
-    pthread_mutex_init(&env->lock_tid,          NULL);
     pthread_mutex_init(&env->lock_loop,         NULL);
-    pthread_rwlock_init(&env->lock_refused, NULL);
-    env->lock_worker_busy = calloc(sizeof(pthread_rwlock_t), env->worker_max);
-    for (int j=0;j<env->worker_max;++j) {
-        pthread_rwlock_init(&env->lock_worker_busy[j], NULL);
-    }
     na_connpool_create(&env->connpool_active, env->connpool_max);
     if (env->is_use_backup) {
         na_connpool_create(&env->connpool_backup, env->connpool_max);
     }
+    if (env->target_server_cnt > 1) {
+        env->connpool_nodes = calloc(sizeof(na_connpool_t), env->target_server_cnt);
+        for (int i=1;i<env->target_server_cnt;++i) {
+            na_connpool_create(&env->connpool_nodes[i], env->connpool_max);
+        }
+        if (!na_ketama_build(env)) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
+    }
 }
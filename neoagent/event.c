@@ -15,43 +15,1357 @@
 
 #include "defines.h"
 
+// EVBACKEND_IOURING is an enum constant of libev 4.31 or later, not a macro
+#if EV_VERSION_MAJOR > 4 || (EV_VERSION_MAJOR == 4 && EV_VERSION_MINOR >= 31)
+#define NA_EVENT_HAVE_IOURING
+#endif
+
+static const int NA_EVENT_DISCARD_BUFSIZE = 1024;
+
+// constants for work-stealing
+static const ev_tstamp NA_EVENT_LOAD_WINDOW     = 0.01; // seconds
+static const int       NA_EVENT_LOAD_SATURATED  = 750;  // permille of busy time
+static const int       NA_EVENT_LOAD_DIFF_MIN   = 250;  // permille
+static const int       NA_EVENT_STEAL_BATCH_MAX = 32;
+
 #define NA_EVENT_FAIL(na_error, loop, w, client, env) do {  \
         na_event_stop(loop, w, client, env);                \
         NA_ERROR_OUTPUT_MESSAGE(env, na_error);                   \
     } while(false)
 
-// globals
-static na_client_t *ClientPool;
-static na_event_queue_t *EventQueue = NULL;
+// globals
+static na_client_t *ClientPool;
+
+// refs to external globals
+na_graceful_phase_t  GracefulPhase;
+
+// private functions
+inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env);
+inline static void na_event_switch (EV_P_ struct ev_io *old, ev_io *new, int fd, int revent);
+inline static void na_event_arm (EV_P_ struct ev_io *w, int revent);
+static void na_event_state_switch (EV_P_ struct ev_io *w, na_client_t *client, na_event_state_t state);
+static void na_event_write_wait (EV_P_ struct ev_io *w, na_client_t *client);
+static void na_event_client_watch (EV_P_ na_client_t *client);
+static void na_event_response_compact (na_client_t *client);
+static void na_event_response_stream (EV_P_ struct ev_io *w, na_client_t *client);
+static bool na_event_noreply_discard (EV_P_ struct ev_io *w, na_client_t *client);
+static void na_event_noreply_abandon (na_client_t *client);
+
+static struct ev_loop *na_event_loop_create (na_event_model_t model);
+static bool na_event_model_is_supported (na_event_model_t model);
+static int na_client_assign_batch (na_env_t *env, int *curs, int n);
+static void na_client_release (na_client_t *client);
+static void na_client_close (EV_P_ na_client_t *client, na_env_t *env);
+static void na_target_server_callback (EV_P_ struct ev_io *w, int revents);
+static void na_client_callback (EV_P_ struct ev_io *w, int revents);
+static void na_target_server_release (na_env_t *env, na_connpool_t *connpool, int cur_pool, int tsfd);
+static int na_front_server_accept (na_env_t *env, int fsfd, na_client_t **clients);
+static void na_front_server_callback (EV_P_ struct ev_io *w, int revents);
+static void na_front_server_reuseport_callback (EV_P_ struct ev_io *w, int revents);
+static void na_event_worker_busy_set(na_env_t *env, int tid, bool is_busy);
+static int na_event_worker_select(na_env_t *env);
+static void na_event_worker_client_start(EV_P_ na_event_worker_t *worker, na_client_t *client);
+static void na_event_worker_client_detach(na_event_worker_t *worker);
+static void na_event_worker_client_enter(EV_P_ na_event_worker_t *worker, na_client_t *client);
+static bool na_event_worker_client_donate(EV_P_ na_client_t *client);
+static bool na_event_response_is_partial (na_client_t *client);
+static void na_event_request_dispatch (EV_P_ struct ev_io *w, na_client_t *client);
+static void na_event_request_barrier (na_client_t *client);
+static void na_event_request_finish (EV_P_ struct ev_io *w, na_client_t *client);
+static bool na_event_request_route (EV_P_ na_client_t *client);
+static bool na_event_target_connect (na_env_t *env, int node, int *fd, int *cur, na_connpool_t **connpool);
+static bool na_event_target_switch (EV_P_ na_client_t *client, int node);
+static bool na_event_fanout_start (EV_P_ na_client_t *client);
+static void na_event_fanout_callback (EV_P_ struct ev_io *w, int revents);
+static void na_event_fanout_deliver (EV_P_ na_client_t *client);
+static void na_event_fanout_release (EV_P_ na_client_t *client);
+static na_server_t *na_event_node_server (na_env_t *env, int node);
+static void na_event_connpool_reconnect (na_env_t *env, na_connpool_t *connpool, int cur, na_server_t *server);
+static bool na_event_target_reset (EV_P_ na_client_t *client);
+static void na_event_hedge_arm (EV_P_ na_client_t *client);
+static void na_event_hedge_timer_callback (EV_P_ ev_timer *w, int revents);
+static void na_event_hedge_callback (EV_P_ struct ev_io *w, int revents);
+static void na_event_hedge_win (EV_P_ na_client_t *client);
+static void na_event_hedge_cancel (EV_P_ na_client_t *client);
+static void na_event_balance_end (na_client_t *client, bool is_sample);
+static bool na_event_request_join (EV_P_ struct ev_io *w, na_client_t *client);
+static void na_event_request_park (EV_P_ na_client_t *client, na_event_state_t state);
+static void na_event_collapse_deliver (EV_P_ na_client_t *leader);
+static void na_event_collapse_abort (EV_P_ na_client_t *leader);
+static void na_event_batch_add (EV_P_ na_event_worker_t *worker, na_client_t *client);
+static void na_event_batch_flush (EV_P_ na_event_worker_t *worker);
+static void na_event_batch_deliver (EV_P_ na_client_t *leader);
+static void na_event_batch_abort (EV_P_ na_client_t *leader);
+static void na_event_batch_timer_callback (EV_P_ ev_timer *w, int revents);
+static bool na_event_worker_offer(na_event_worker_t *worker, na_client_t *client);
+static void na_event_worker_steal(EV_P_ na_event_worker_t *worker);
+static int na_event_worker_thief_select(na_event_worker_t *worker);
+static void na_event_worker_async_callback(EV_P_ ev_async *w, int revents);
+static void na_event_worker_prepare_callback(EV_P_ ev_prepare *w, int revents);
+static void na_event_worker_check_callback(EV_P_ ev_check *w, int revents);
+static void na_front_server_prepare_callback(EV_P_ ev_prepare *w, int revents);
+static void na_front_server_check_callback(EV_P_ ev_check *w, int revents);
+static bool na_event_affinity_setup (na_env_t *env, cpu_set_t *cpuset);
+static void *na_event_observer(void *args);
+static void *na_support_loop (void *args);
+
+inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env)
+{
+    ev_io_stop(EV_A_ w);
+    na_client_close(EV_A_ client, env);
+}
+
+inline static void na_event_switch (EV_P_ struct ev_io *old, struct ev_io *new, int fd, int revent)
+{
+    ev_io_stop(EV_A_ old);
+    ev_io_stop(EV_A_ new);
+    ev_io_set(new, fd, revent);
+    ev_io_start(EV_A_ new);
+}
+
+/**
+ * touch the watcher only when its events change.
+ */
+inline static void na_event_arm (EV_P_ struct ev_io *w, int revent)
+{
+    if (ev_is_active(w) && (w->events & (EV_READ | EV_WRITE)) == revent) {
+        return;
+    }
+    ev_io_stop(EV_A_ w);
+    ev_io_set(w, w->fd, revent);
+    ev_io_start(EV_A_ w);
+}
+
+/**
+ * move the client to the next state.
+ *
+ * with persistent_watcher, both watchers stay registered for reading
+ * through the connection and writes are tried inline. the write watcher
+ * is armed only when a write would block. the client must not be
+ * touched after this returns because an inline write may close it.
+ */
+static void na_event_state_switch (EV_P_ struct ev_io *w, na_client_t *client, na_event_state_t state)
+{
+    client->event_state = state;
+
+    if (!client->env->is_persistent_watcher) {
+        switch (state) {
+        case NA_EVENT_STATE_CLIENT_READ:
+            na_event_switch(EV_A_ w, &client->c_watcher, client->cfd, EV_READ);
+            if (client->noreply_mn_cnt > 0) {
+                na_event_arm(EV_A_ &client->ts_watcher, EV_READ);
+            }
+            break;
+        case NA_EVENT_STATE_TARGET_WRITE:
+            na_event_switch(EV_A_ w, &client->ts_watcher, client->tsfd, EV_WRITE);
+            break;
+        case NA_EVENT_STATE_TARGET_READ:
+            na_event_switch(EV_A_ w, &client->ts_watcher, client->tsfd, EV_READ);
+            break;
+        case NA_EVENT_STATE_CLIENT_WRITE:
+            na_event_switch(EV_A_ w, &client->c_watcher, client->cfd, EV_WRITE);
+            break;
+        default:
+            // no through
+            assert(false);
+            break;
+        }
+        return;
+    }
+
+    switch (state) {
+    case NA_EVENT_STATE_CLIENT_READ:
+        na_event_arm(EV_A_ &client->c_watcher,  EV_READ);
+        na_event_arm(EV_A_ &client->ts_watcher, EV_READ);
+        break;
+    case NA_EVENT_STATE_TARGET_WRITE:
+        na_target_server_callback(EV_A_ &client->ts_watcher, EV_WRITE);
+        break;
+    case NA_EVENT_STATE_TARGET_READ:
+        na_event_arm(EV_A_ &client->ts_watcher, EV_READ);
+        na_event_arm(EV_A_ &client->c_watcher,  EV_READ);
+        break;
+    case NA_EVENT_STATE_CLIENT_WRITE:
+        na_client_callback(EV_A_ &client->c_watcher, EV_WRITE);
+        break;
+    default:
+        // no through
+        assert(false);
+        break;
+    }
+}
+
+/**
+ * wait until the fd of w becomes writable again.
+ */
+static void na_event_write_wait (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    if (client->env->is_persistent_watcher) {
+        na_event_arm(EV_A_ w, EV_WRITE);
+    }
+}
+
+/**
+ * discard the part of the response which is already written to the client.
+ */
+static void na_event_response_compact (na_client_t *client)
+{
+    int keep;
+
+    keep = na_memproto_res_parser_keep(&client->res_parser);
+    if (keep > client->cwbufsize) {
+        keep = client->cwbufsize;
+    }
+    if (keep == 0) {
+        return;
+    }
+
+    memmove(client->srbuf, client->srbuf + keep, client->srbufsize - keep);
+    client->srbufsize               -= keep;
+    client->cwbufsize               -= keep;
+    client->srbuf[client->srbufsize] = '\0';
+    na_memproto_res_parser_shift(&client->res_parser, keep);
+}
+
+/**
+ * forward the part of the response received so far.
+ * reading from the target server is suspended while the client is not writable.
+ */
+static void na_event_response_stream (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    int size;
+    na_env_t *env;
+
+    env = client->env;
+
+    if ((client->na_to_client_time_begin.tv_sec == 0) &&
+        (client->na_to_client_time_begin.tv_nsec == 0))
+    {
+        na_slow_query_gettime(env, &client->na_to_client_time_begin);
+    }
+
+    size = write(client->cfd,
+                 client->srbuf + client->cwbufsize,
+                 client->srbufsize - client->cwbufsize);
+
+    if (size == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            if (errno == EPIPE) {
+                NA_EVENT_FAIL(NA_ERROR_BROKEN_PIPE, EV_A, w, client, env);
+            } else {
+                NA_EVENT_FAIL(NA_ERROR_FAILED_WRITE, EV_A, w, client, env);
+            }
+            return;
+        }
+        size = 0;
+    }
+
+    client->cwbufsize += size;
+    na_event_response_compact(client);
+
+    if (client->cwbufsize < client->srbufsize) {
+        na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_CLIENT_WRITE);
+    }
+}
+
+/**
+ * replies to noreply requests(errors only) are discarded up to MN of
+ * the barriers sent after them. the data is peeked so that the response
+ * of the next request following MN is left in the socket.
+ * returns true when all of the barriers are received.
+ */
+static bool na_event_noreply_discard (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    int size, error_cnt;
+    char buf[NA_EVENT_DISCARD_BUFSIZE];
+
+    size = recv(w->fd, buf, sizeof(buf), MSG_PEEK);
+
+    if (size <= 0) {
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return false; // not ready yet
+        }
+        NA_EVENT_FAIL(NA_ERROR_FAILED_READ, EV_A, w, client, client->env);
+        return false;
+    }
+
+    error_cnt = 0;
+    size      = na_memproto_noreply_skip(buf, size, &client->noreply_mn_cnt, &client->noreply_match, &error_cnt);
+
+    if (read(w->fd, buf, size) != size) {
+        NA_EVENT_FAIL(NA_ERROR_FAILED_READ, EV_A, w, client, client->env);
+        return false;
+    }
+
+    if (client->worker != NULL && error_cnt > 0) {
+        atomic_fetch_add_explicit(&client->worker->noreply_error_cnt, error_cnt, memory_order_relaxed);
+    }
+
+    return client->noreply_mn_cnt == 0;
+}
+
+/**
+ * the connection leaves the client before the barriers of noreply requests
+ * are received. a connection of the pool is made again so that the replies
+ * never reach other client.
+ */
+static void na_event_noreply_abandon (na_client_t *client)
+{
+    if (client->noreply_mn_cnt > 0 && client->is_use_connpool) {
+        na_event_connpool_reconnect(client->env, client->connpool, client->cur_pool,
+                                    na_event_node_server(client->env, client->node));
+    }
+    client->noreply_mn_cnt = 0;
+    client->noreply_match  = 0;
+}
+
+/**
+ * the client has written all of the response received so far
+ * but responses for some of the forwarded requests are still missing.
+ */
+static bool na_event_response_is_partial (na_client_t *client)
+{
+    if (client->cmd != NA_MEMPROTO_CMD_GET && client->res_parser.kind_cnt == 0) {
+        return false;
+    }
+    return client->res_cnt < client->req_cnt;
+}
+
+/**
+ * forward the request read so far when it is complete.
+ *
+ * with pipelining, complete requests at the head of the buffer are
+ * framed and forwarded back-to-back. their responses are matched in
+ * order and the rest of the buffer is dispatched after they are written.
+ */
+static void na_event_request_dispatch (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    long reqsize;
+    int keylen, node;
+    bool is_translated;
+    const char *key;
+    na_env_t *env;
+
+    env         = client->env;
+    client->cmd = na_memproto_detect_command(client->crbuf);
+
+    is_translated = env->upstream_protocol != NA_UPSTREAM_PROTOCOL_TEXT &&
+                    client->cmd != NA_MEMPROTO_CMD_BINARY && client->cmd != NA_MEMPROTO_CMD_META;
+
+    if (env->is_request_streaming && !is_translated &&
+        (client->cmd == NA_MEMPROTO_CMD_SET || client->cmd == NA_MEMPROTO_CMD_ADD))
+    {
+        reqsize = na_memproto_storage_request_size(client->crbuf, client->crbufsize);
+        if (reqsize < 0) {
+            NA_EVENT_FAIL(NA_ERROR_INVALID_CMD, EV_A, w, client, env);
+            return; // request fail
+        } else if (reqsize == 0) {
+            return; // not ready yet
+        } else if (reqsize > client->crbufsize) {
+            node = 0;
+            if (env->is_replica_balancing) {
+                node = na_balance_node(env);
+            } else if (env->target_server_cnt > 1) {
+                if (na_memproto_request_key(client->cmd, client->crbuf, client->crbufsize, &key, &keylen) < 0) {
+                    NA_EVENT_FAIL(NA_ERROR_INVALID_CMD, EV_A, w, client, env);
+                    return; // request fail
+                }
+                node = na_ketama_node(env, key, keylen);
+            }
+            if (!na_event_target_switch(EV_A_ client, node)) {
+                NA_EVENT_FAIL(NA_ERROR_CONNECTION_FAILED, EV_A, w, client, env);
+                return; // request fail
+            }
+            // forward the data block while it is arriving
+            na_memproto_res_parser_expect(&client->res_parser, client->cmd, client->crbuf, client->crbufsize);
+            client->req_cnt    = client->res_parser.kind_cnt;
+            client->is_noreply = client->req_cnt == 0;
+            client->req_remain = reqsize - client->crbufsize;
+            client->crframed   = client->crbufsize;
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_WRITE);
+            return;
+        }
+    }
+
+    if (client->cmd == NA_MEMPROTO_CMD_QUIT) {
+        na_event_stop(EV_A_ w, client, env);
+        return; // request success
+    }
+
+    // binary, meta, translated and noreply commands and requests to multiple target servers are always framed
+    if (env->is_pipelining || is_translated || env->target_server_cnt > 1 ||
+        client->cmd == NA_MEMPROTO_CMD_BINARY || client->cmd == NA_MEMPROTO_CMD_META ||
+        na_memproto_request_is_noreply(client->crbuf, client->crbufsize))
+    {
+        if (client->cmd == NA_MEMPROTO_CMD_BINARY) {
+            client->crframed = na_memproto_bin_frame_requests(&client->res_parser, client->crbuf, client->crbufsize);
+        } else {
+            client->crframed = na_memproto_frame_requests(&client->res_parser, client->crbuf, client->crbufsize);
+        }
+        if (client->crframed < 0) {
+            na_event_stop(EV_A_ w, client, env);
+            return; // request fail
+        } else if (client->crframed == 0) {
+            return; // not ready yet
+        }
+        if (!na_event_request_route(EV_A_ client)) {
+            NA_EVENT_FAIL(NA_ERROR_CONNECTION_FAILED, EV_A, w, client, env);
+            return; // request fail
+        } else if (client->event_state == NA_EVENT_STATE_FANOUT) {
+            return; // waits for the gets of the keys to each target server
+        }
+        // a batch leader and clients of an aborted batch are forwarded with these
+        client->req_cnt    = client->res_parser.kind_cnt;
+        client->is_noreply = client->req_cnt == 0;
+        if (na_event_request_join(EV_A_ w, client)) {
+            return; // waits for the response of other client
+        }
+        if (is_translated) {
+            client->req_cnt = na_translate_request(client, env->upstream_protocol);
+            if (client->req_cnt < 0) {
+                na_event_stop(EV_A_ w, client, env);
+                return; // request fail
+            }
+            na_memproto_res_parser_init(&client->res_parser);
+            client->res_parser.is_meta = env->upstream_protocol == NA_UPSTREAM_PROTOCOL_META;
+            client->is_translated      = true;
+            client->is_noreply         = false; // every translated request is answered
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_WRITE);
+            return;
+        }
+        // replies to noreply requests end with MN of the barrier as well
+        if (client->res_parser.is_barrier || client->is_noreply) {
+            na_event_request_barrier(client);
+        }
+        na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_WRITE);
+        return;
+    }
+
+    if (client->cmd == NA_MEMPROTO_CMD_GET || client->cmd == NA_MEMPROTO_CMD_SET) {
+        client->req_cnt = na_memproto_count_request_get(client->crbuf, client->crbufsize);
+    }
+
+    if (client->crbufsize < 2) {
+        return; // not ready yet
+    } else if (client->crbuf[client->crbufsize - 2] == '\r' &&
+               client->crbuf[client->crbufsize - 1] == '\n')
+    {
+        if (client->cmd == NA_MEMPROTO_CMD_UNKNOWN) {
+            na_event_stop(EV_A_ w, client, env);
+            return; // request fail
+        } else if (client->cmd == NA_MEMPROTO_CMD_SET && client->req_cnt < 2) {
+            return; // not ready yet
+        }
+        client->crframed = client->crbufsize;
+        if (na_event_request_join(EV_A_ w, client)) {
+            return; // waits for the response of other client
+        }
+        na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_WRITE);
+    }
+}
+
+/**
+ * with multiple target servers, the framed requests go to the server of their keys.
+ * framing is cut before the first request for other server and the rest is
+ * dispatched after the responses of the head are written.
+ * with replica_balancing, all of the framed requests go to the replica chosen for them.
+ * returns false when the request is malformed or the server is not connected.
+ */
+static bool na_event_request_route (EV_P_ na_client_t *client)
+{
+    int routed, size, keylen, node, n;
+    bool is_fanout;
+    const char *key;
+    na_env_t *env;
+
+    env = client->env;
+
+    if (env->target_server_cnt <= 1) {
+        return true;
+    }
+
+    if (env->is_replica_balancing) {
+        return na_event_target_switch(EV_A_ client, na_balance_node(env));
+    }
+
+    node      = -1;
+    routed    = 0;
+    is_fanout = false;
+    while (routed < client->crframed) {
+        size = na_memproto_request_key(client->cmd, client->crbuf + routed, client->crframed - routed, &key, &keylen);
+        if (size < 0 || size > client->crframed - routed) {
+            return false;
+        }
+        // a multi-key get over several servers is split and sent alone
+        if (client->cmd != NA_MEMPROTO_CMD_BINARY && env->upstream_protocol == NA_UPSTREAM_PROTOCOL_TEXT &&
+            na_fanout_is_spread(env, client->crbuf + routed, size))
+        {
+            if (routed == 0) {
+                is_fanout = true;
+                routed    = size;
+            }
+            break;
+        }
+        // a request without key goes with the requests around it
+        n = keylen > 0 ? na_ketama_node(env, key, keylen) : node;
+        if (node == -1) {
+            node = n;
+        } else if (n != -1 && n != node) {
+            break;
+        }
+        routed += size;
+    }
+
+    if (routed < client->crframed) {
+        na_memproto_res_parser_init(&client->res_parser);
+        if (client->cmd == NA_MEMPROTO_CMD_BINARY) {
+            client->crframed = na_memproto_bin_frame_requests(&client->res_parser, client->crbuf, routed);
+        } else {
+            client->crframed = na_memproto_frame_requests(&client->res_parser, client->crbuf, routed);
+        }
+    }
+
+    if (is_fanout) {
+        return na_event_fanout_start(EV_A_ client);
+    }
+
+    return node == -1 || na_event_target_switch(EV_A_ client, node);
+}
+
+/**
+ * a connection to target_servers[node]. a connection of the pool of
+ * the server is leased when there is free one, otherwise a dedicated one
+ * is connected and cur is -1.
+ */
+static bool na_event_target_connect (na_env_t *env, int node, int *fd, int *cur, na_connpool_t **connpool)
+{
+    na_server_t *server;
+
+    *connpool = na_connpool_node(env, node);
+    server    = &env->target_servers[node];
+
+    if (na_connpool_assign(env, *connpool, cur, fd, server)) {
+        return true;
+    }
+
+    *cur = -1;
+    *fd  = na_target_server_tcpsock_init();
+    if (*fd < 0) {
+        return false;
+    }
+    na_target_server_tcpsock_setup(*fd, true);
+    if (!na_server_connect(*fd, &server->addr) && errno != EINPROGRESS && errno != EALREADY) {
+        close(*fd);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * move the upstream connection of the client to target_servers[node].
+ */
+static bool na_event_target_switch (EV_P_ na_client_t *client, int node)
+{
+    int fd, cur;
+    na_env_t *env;
+    na_connpool_t *connpool;
+
+    if (node == client->node) {
+        return true;
+    }
+
+    env = client->env;
+
+    if (!na_event_target_connect(env, node, &fd, &cur, &connpool)) {
+        return false;
+    }
+
+    ev_io_stop(EV_A_ &client->ts_watcher);
+    na_event_noreply_abandon(client);
+    na_target_server_release(env, client->connpool, client->cur_pool, client->tsfd);
+
+    client->tsfd            = fd;
+    client->cur_pool        = cur;
+    client->connpool        = connpool;
+    client->is_use_connpool = cur != -1 ? true : false;
+    client->node            = node;
+
+    ev_io_set(&client->ts_watcher, fd, EV_READ);
+    if (env->is_persistent_watcher) {
+        ev_io_start(EV_A_ &client->ts_watcher);
+    }
+
+    return true;
+}
+
+/**
+ * the get of each target server is sent on its own connection at once.
+ * the client is parked until every server responds.
+ */
+static bool na_event_fanout_start (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+    na_fanout_t *fanout;
+    na_fanout_leg_t *leg;
+
+    env    = client->env;
+    fanout = na_fanout_create(env, client->crbuf, client->crframed);
+    if (fanout == NULL) {
+        return false;
+    }
+
+    client->fanout  = fanout;
+    client->req_cnt = 1;
+    na_event_request_park(EV_A_ client, NA_EVENT_STATE_FANOUT);
+    na_slow_query_gettime(env, &client->na_to_ts_time_begin);
+
+    if (client->worker != NULL) {
+        atomic_fetch_add_explicit(&client->worker->fanout_hist[na_batch_hist_index(fanout->leg_cnt)], 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&client->worker->fanout_dedup_cnt, fanout->dup_cnt, memory_order_relaxed);
+    }
+
+    for (int i=0;i<fanout->leg_cnt;++i) {
+        leg = &fanout->legs[i];
+        if (!na_event_target_connect(env, leg->node, &leg->fd, &leg->cur_pool, &leg->connpool)) {
+            leg->fd = -1;
+            return false;
+        }
+        leg->client         = client;
+        leg->watcher.data   = leg;
+        ev_io_init(&leg->watcher, na_event_fanout_callback, leg->fd, EV_WRITE);
+        ev_io_start(EV_A_ &leg->watcher);
+    }
+
+    return true;
+}
+
+/**
+ * the latency of the split get is the one of the slowest server
+ * because the timestamps of the end are taken by the last leg.
+ */
+static void na_event_fanout_callback (EV_P_ struct ev_io *w, int revents)
+{
+    int size;
+    na_client_t *client;
+    na_env_t *env;
+    na_topology_t *topology;
+    na_fanout_t *fanout;
+    na_fanout_leg_t *leg;
+
+    leg    = (na_fanout_leg_t *)w->data;
+    client = leg->client;
+    env    = client->env;
+    fanout = client->fanout;
+
+    topology = na_topology_current(env);
+    if ((client->topology_epoch != topology->epoch) || topology->is_refused_accept) {
+        NA_EVENT_FAIL(NA_ERROR_INVALID_CONNPOOL, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+
+    if (env->loop_max > 0 && client->loop_cnt++ > env->loop_max) {
+        NA_EVENT_FAIL(NA_ERROR_OUTOF_LOOP, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+
+    if (revents & EV_WRITE) {
+        size = write(w->fd, leg->wbuf + leg->swbufsize, leg->wbufsize - leg->swbufsize);
+        if (size == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return; // not ready yet
+            }
+            NA_EVENT_FAIL(errno == EPIPE ? NA_ERROR_BROKEN_PIPE : NA_ERROR_FAILED_WRITE, EV_A, &client->c_watcher, client, env);
+            return; // request fail
+        }
+        leg->swbufsize += size;
+        if (leg->swbufsize == leg->wbufsize) {
+            na_slow_query_gettime(env, &client->na_to_ts_time_end);
+            na_event_switch(EV_A_ w, w, leg->fd, EV_READ);
+        }
+        return;
+    }
+
+    if ((client->na_from_ts_time_begin.tv_sec == 0) &&
+        (client->na_from_ts_time_begin.tv_nsec == 0))
+    {
+        na_slow_query_gettime(env, &client->na_from_ts_time_begin);
+    }
+
+    if (!na_fanout_rbuf_reserve(leg)) {
+        NA_EVENT_FAIL(NA_ERROR_OUTOF_MEMORY, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+
+    size = read(w->fd, leg->rbuf + leg->rbufsize, leg->rbufcap - leg->rbufsize);
+    if (size <= 0) {
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return; // not ready yet
+        }
+        NA_EVENT_FAIL(NA_ERROR_FAILED_READ, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+    leg->rbufsize             += size;
+    leg->rbuf[leg->rbufsize]   = '\0';
+
+    size = na_memproto_res_parse(&leg->res_parser, leg->rbuf, leg->rbufsize);
+    if (size < 0) {
+        NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    } else if (size == 0) {
+        return; // not ready yet
+    }
+
+    // the connection is given back as soon as the leg is answered
+    ev_io_stop(EV_A_ w);
+    na_target_server_release(env, leg->connpool, leg->cur_pool, leg->fd);
+    leg->fd = -1;
+
+    if (++fanout->done_cnt == fanout->leg_cnt) {
+        na_event_fanout_deliver(EV_A_ client);
+    }
+}
+
+static void na_event_fanout_deliver (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+
+    env = client->env;
+
+    if (!na_fanout_response(client->fanout, client->crbuf, &client->srbuf, &client->srbufsize, &client->response_bufsize)) {
+        NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+    na_slow_query_gettime(env, &client->na_from_ts_time_end);
+    na_event_fanout_release(EV_A_ client);
+
+    client->res_cnt = client->req_cnt;
+    // an inline write may close the client
+    na_event_state_switch(EV_A_ &client->c_watcher, client, NA_EVENT_STATE_CLIENT_WRITE);
+}
+
+/**
+ * connections of the legs which are not answered yet may have a response
+ * in flight. pooled ones are made again before they are given back.
+ */
+static void na_event_fanout_release (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+    na_fanout_leg_t *leg;
+
+    env = client->env;
+
+    for (int i=0;i<client->fanout->leg_cnt;++i) {
+        leg = &client->fanout->legs[i];
+        if (leg->fd != -1) {
+            ev_io_stop(EV_A_ &leg->watcher);
+            if (leg->cur_pool != -1) {
+                na_event_connpool_reconnect(env, leg->connpool, leg->cur_pool, na_event_node_server(env, leg->node));
+            }
+            na_target_server_release(env, leg->connpool, leg->cur_pool, leg->fd);
+            leg->fd = -1;
+        }
+    }
+
+    na_fanout_destroy(client->fanout);
+    client->fanout = NULL;
+}
+
+/**
+ * target_servers[node]. the first one follows the health check.
+ */
+static na_server_t *na_event_node_server (na_env_t *env, int node)
+{
+    if (node == 0) {
+        return na_topology_current(env)->server;
+    }
+    return &env->target_servers[node];
+}
+
+/**
+ * the connection of the pool is replaced with a new one to the server.
+ */
+static void na_event_connpool_reconnect (na_env_t *env, na_connpool_t *connpool, int cur, na_server_t *server)
+{
+    pthread_mutex_lock(&env->lock_connpool);
+    if (connpool->fd_pool[cur] > 0) {
+        close(connpool->fd_pool[cur]);
+    }
+    connpool->fd_pool[cur] = na_target_server_tcpsock_init();
+    na_target_server_tcpsock_setup(connpool->fd_pool[cur], true);
+    if (connpool->fd_pool[cur] <= 0) {
+        pthread_mutex_unlock(&env->lock_connpool);
+        NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+    }
+
+    if (!na_server_connect(connpool->fd_pool[cur], &server->addr)) {
+        if (errno != EINPROGRESS && errno != EALREADY) {
+            pthread_mutex_unlock(&env->lock_connpool);
+            NA_DIE_WITH_ERROR(env, NA_ERROR_CONNECTION_FAILED);
+        }
+    }
+    pthread_mutex_unlock(&env->lock_connpool);
+}
+
+/**
+ * the upstream connection of the client is made again to the same server.
+ * the response in flight on the old one is abandoned with it.
+ */
+static bool na_event_target_reset (EV_P_ na_client_t *client)
+{
+    int fd;
+    na_env_t *env;
+    na_server_t *server;
+
+    env    = client->env;
+    server = na_event_node_server(env, client->node);
+
+    ev_io_stop(EV_A_ &client->ts_watcher);
+
+    if (client->is_use_connpool) {
+        na_event_connpool_reconnect(env, client->connpool, client->cur_pool, server);
+        fd = client->connpool->fd_pool[client->cur_pool];
+    } else {
+        close(client->tsfd);
+        client->tsfd = -1;
+        fd = na_target_server_tcpsock_init();
+        if (fd < 0) {
+            return false;
+        }
+        na_target_server_tcpsock_setup(fd, true);
+        if (!na_server_connect(fd, &server->addr) && errno != EINPROGRESS && errno != EALREADY) {
+            close(fd);
+            return false;
+        }
+    }
+
+    client->tsfd           = fd;
+    client->noreply_mn_cnt = 0;
+    client->noreply_match  = 0;
+    ev_io_set(&client->ts_watcher, fd, EV_READ);
+    if (env->is_persistent_watcher) {
+        ev_io_start(EV_A_ &client->ts_watcher);
+    }
+
+    return true;
+}
+
+/**
+ * a get which the active server does not answer within hedge_delay_usec
+ * is sent to backup_server as well and the first complete response wins.
+ * only a get line alone is hedged because the response must be
+ * the same whichever server answers.
+ */
+static void na_event_hedge_arm (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+
+    env = client->env;
+
+    if (env->hedge_delay_usec == 0 || !env->is_use_backup || na_topology_current(env)->is_refused_active) {
+        return;
+    }
+    if (client->cmd != NA_MEMPROTO_CMD_GET || client->is_translated || client->is_batch_leader ||
+        client->crframed < 6 || memcmp(client->crbuf, "get ", 4) != 0 ||
+        na_scan_byte(client->crbuf, client->crframed, '\n') != client->crbuf + client->crframed - 1)
+    {
+        return;
+    }
+
+    ev_timer_set(&client->hedge_timer, env->hedge_delay_usec / 1000000., 0.);
+    ev_timer_start(EV_A_ &client->hedge_timer);
+}
+
+/**
+ * hedging is best effort. the get goes on without it when backup_server is not reachable.
+ */
+static void na_event_hedge_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    int fd;
+    na_client_t *client;
+    na_env_t *env;
+    na_fanout_leg_t *leg;
+
+    client = (na_client_t *)w->data;
+    env    = client->env;
 
-// refs to external globals
-na_graceful_phase_t  GracefulPhase;
+    // the active server has begun to answer
+    if (client->event_state != NA_EVENT_STATE_TARGET_READ || client->srbufsize > 0) {
+        return;
+    }
 
-// private functions
-inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env);
-inline static void na_event_switch (EV_P_ struct ev_io *old, ev_io *new, int fd, int revent);
+    fd = na_target_server_tcpsock_init();
+    if (fd < 0) {
+        return;
+    }
+    na_target_server_tcpsock_setup(fd, true);
+    if (!na_server_connect(fd, &env->backup_server.addr) && errno != EINPROGRESS && errno != EALREADY) {
+        close(fd);
+        return;
+    }
 
-static struct ev_loop *na_event_loop_create (na_event_model_t model);
-static int na_client_assign (na_env_t *env);
-static void na_client_close (EV_P_ na_client_t *client, na_env_t *env);
-static void na_target_server_callback (EV_P_ struct ev_io *w, int revents);
-static void na_client_callback (EV_P_ struct ev_io *w, int revents);
-static void na_front_server_callback (EV_P_ struct ev_io *w, int revents);
-static bool na_is_worker_busy(na_env_t *env);
-static void *na_event_observer(void *args);
-static void *na_support_loop (void *args);
+    leg = na_fanout_leg_create(client->crbuf, client->crframed);
+    if (leg == NULL) {
+        close(fd);
+        return;
+    }
+    leg->fd           = fd;
+    leg->client       = client;
+    leg->watcher.data = leg;
+    ev_io_init(&leg->watcher, na_event_hedge_callback, fd, EV_WRITE);
+    ev_io_start(EV_A_ &leg->watcher);
+    client->hedge = leg;
+
+    if (client->worker != NULL) {
+        atomic_fetch_add_explicit(&client->worker->hedge_cnt, 1, memory_order_relaxed);
+    }
+}
 
-inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env)
+static void na_event_hedge_callback (EV_P_ struct ev_io *w, int revents)
 {
-    ev_io_stop(EV_A_ w);
-    na_client_close(EV_A_ client, env);
+    int size;
+    na_client_t *client;
+    na_fanout_leg_t *leg;
+
+    leg    = (na_fanout_leg_t *)w->data;
+    client = leg->client;
+
+    if (revents & EV_WRITE) {
+        size = write(w->fd, leg->wbuf + leg->swbufsize, leg->wbufsize - leg->swbufsize);
+        if (size == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return; // not ready yet
+            }
+            na_event_hedge_cancel(EV_A_ client);
+            return; // the active server answers
+        }
+        leg->swbufsize += size;
+        if (leg->swbufsize == leg->wbufsize) {
+            na_event_switch(EV_A_ w, w, leg->fd, EV_READ);
+        }
+        return;
+    }
+
+    if (!na_fanout_rbuf_reserve(leg)) {
+        na_event_hedge_cancel(EV_A_ client);
+        return;
+    }
+
+    size = read(w->fd, leg->rbuf + leg->rbufsize, leg->rbufcap - leg->rbufsize);
+    if (size <= 0) {
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return; // not ready yet
+        }
+        na_event_hedge_cancel(EV_A_ client);
+        return;
+    }
+    leg->rbufsize             += size;
+    leg->rbuf[leg->rbufsize]   = '\0';
+
+    size = na_memproto_res_parse(&leg->res_parser, leg->rbuf, leg->rbufsize);
+    if (size < 0) {
+        na_event_hedge_cancel(EV_A_ client);
+        return;
+    } else if (size == 0) {
+        return; // not ready yet
+    }
+
+    na_event_hedge_win(EV_A_ client);
 }
 
-inline static void na_event_switch (EV_P_ struct ev_io *old, struct ev_io *new, int fd, int revent)
+/**
+ * backup_server answers first. the response is taken over by the client.
+ */
+static void na_event_hedge_win (EV_P_ na_client_t *client)
 {
-    ev_io_stop(EV_A_ old);
-    ev_io_set(new, fd, revent);
-    ev_io_start(EV_A_ new);
+    char *srbuf;
+    na_env_t *env;
+    na_fanout_leg_t *leg;
+
+    env = client->env;
+    leg = client->hedge;
+
+    if (!na_event_target_reset(EV_A_ client)) {
+        NA_EVENT_FAIL(NA_ERROR_CONNECTION_FAILED, EV_A, &client->c_watcher, client, env);
+        return; // request fail
+    }
+    na_event_balance_end(client, true);
+
+    if (leg->rbufsize > client->response_bufsize) {
+        srbuf = (char *)realloc(client->srbuf, leg->rbufsize + 1);
+        if (srbuf == NULL) {
+            NA_EVENT_FAIL(NA_ERROR_OUTOF_MEMORY, EV_A, &client->c_watcher, client, env);
+            return; // request fail
+        }
+        client->srbuf            = srbuf;
+        client->response_bufsize = leg->rbufsize;
+    }
+    memcpy(client->srbuf, leg->rbuf, leg->rbufsize);
+    client->srbufsize                = leg->rbufsize;
+    client->srbuf[client->srbufsize] = '\0';
+    client->res_cnt                  = client->req_cnt;
+
+    na_event_hedge_cancel(EV_A_ client);
+    if (client->worker != NULL) {
+        atomic_fetch_add_explicit(&client->worker->hedge_win_cnt, 1, memory_order_relaxed);
+    }
+
+    na_slow_query_gettime(env, &client->na_from_ts_time_end);
+    if (client->is_collapse_leader) {
+        na_event_collapse_deliver(EV_A_ client);
+    }
+    // an inline write may close the client
+    na_event_state_switch(EV_A_ &client->ts_watcher, client, NA_EVENT_STATE_CLIENT_WRITE);
+}
+
+/**
+ * the request of the client leaves the requests in flight of its server.
+ */
+static void na_event_balance_end (na_client_t *client, bool is_sample)
+{
+    if (client->balance_connpool == NULL) {
+        return;
+    }
+
+    na_balance_end(client->balance_connpool, client->balance_begin, is_sample);
+    client->balance_connpool = NULL;
+}
+
+static void na_event_hedge_cancel (EV_P_ na_client_t *client)
+{
+    ev_timer_stop(EV_A_ &client->hedge_timer);
+
+    if (client->hedge == NULL) {
+        return;
+    }
+
+    ev_io_stop(EV_A_ &client->hedge->watcher);
+    close(client->hedge->fd);
+    na_fanout_leg_destroy(client->hedge);
+    client->hedge = NULL;
+}
+
+/**
+ * a get of a single key is answered with the response of other client
+ * of the worker. it joins the fetch of the same key in flight(request_collapsing)
+ * or is merged into the multi-key get of the batch(batch_window_usec).
+ * returns true when the client is parked until the response arrives.
+ */
+static bool na_event_request_join (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    na_env_t *env;
+    na_event_worker_t *worker;
+
+    env    = client->env;
+    worker = client->worker;
+
+    if (worker == NULL || client->cmd != NA_MEMPROTO_CMD_GET ||
+        (!env->is_request_collapsing && env->batch_window_usec == 0))
+    {
+        return false;
+    }
+
+    if (!na_memproto_get_key(client->crbuf, client->crframed, client->get_key)) {
+        return false;
+    }
+
+    if (env->is_request_collapsing && na_collapse_join(worker, client) != NULL) {
+        na_event_request_park(EV_A_ client, NA_EVENT_STATE_COLLAPSED);
+        return true;
+    }
+
+    // translated gets are not merged because every key is a request of the upstream protocol
+    if (env->batch_window_usec > 0 && env->upstream_protocol == NA_UPSTREAM_PROTOCOL_TEXT) {
+        na_event_request_park(EV_A_ client, NA_EVENT_STATE_BATCHED);
+        na_event_batch_add(EV_A_ worker, client);
+        return true;
+    }
+
+    return false; // the client fetches the key by itself
+}
+
+/**
+ * nothing is read or written for the client while it is parked.
+ */
+static void na_event_request_park (EV_P_ na_client_t *client, na_event_state_t state)
+{
+    ev_io_stop(EV_A_ &client->c_watcher);
+    ev_io_stop(EV_A_ &client->ts_watcher);
+    client->event_state = state;
+}
+
+/**
+ * copy the response of the leader to its waiters.
+ */
+static void na_event_collapse_deliver (EV_P_ na_client_t *leader)
+{
+    int cnt;
+    na_client_t *waiter, *next;
+
+    cnt = 0;
+    for (waiter=na_collapse_leave(leader->worker, leader);waiter!=NULL;waiter=next) {
+        next                  = waiter->collapse_next;
+        waiter->collapse_next = NULL;
+
+        if (leader->srbufsize > waiter->response_bufsize) {
+            waiter->srbuf            = (char *)realloc(waiter->srbuf, leader->srbufsize + 1);
+            waiter->response_bufsize = leader->srbufsize;
+        }
+        memcpy(waiter->srbuf, leader->srbuf, leader->srbufsize + 1);
+        waiter->srbufsize             = leader->srbufsize;
+        waiter->res_cnt               = waiter->req_cnt;
+        waiter->na_to_ts_time_begin   = leader->na_to_ts_time_begin;
+        waiter->na_to_ts_time_end     = leader->na_to_ts_time_end;
+        waiter->na_from_ts_time_begin = leader->na_from_ts_time_begin;
+        waiter->na_from_ts_time_end   = leader->na_from_ts_time_end;
+
+        // an inline write may close the waiter
+        na_event_state_switch(EV_A_ &waiter->c_watcher, waiter, NA_EVENT_STATE_CLIENT_WRITE);
+        ++cnt;
+    }
+
+    if (cnt > 0) {
+        atomic_fetch_add_explicit(&leader->worker->collapse_cnt,       cnt, memory_order_relaxed);
+        atomic_fetch_add_explicit(&leader->worker->collapse_fetch_cnt, 1,   memory_order_relaxed);
+    }
+}
+
+/**
+ * the leader is closed before the response arrives.
+ * the waiters are dispatched again and one of them becomes the next leader.
+ */
+static void na_event_collapse_abort (EV_P_ na_client_t *leader)
+{
+    na_client_t *waiter, *next;
+
+    for (waiter=na_collapse_leave(leader->worker, leader);waiter!=NULL;waiter=next) {
+        next                  = waiter->collapse_next;
+        waiter->collapse_next = NULL;
+        waiter->event_state   = NA_EVENT_STATE_CLIENT_READ;
+        waiter->crframed      = 0;
+        waiter->req_cnt       = 0;
+        waiter->res_cnt       = 0;
+        na_memproto_res_parser_init(&waiter->res_parser);
+        na_event_request_dispatch(EV_A_ &waiter->c_watcher, waiter);
+    }
+}
+
+/**
+ * the first get of the batch opens the window and
+ * the batch is flushed when it closes or batch_key_max gets are queued.
+ */
+static void na_event_batch_add (EV_P_ na_event_worker_t *worker, na_client_t *client)
+{
+    na_env_t *env;
+
+    env = worker->env;
+
+    // a batch is sent to a single target server. any of the replicas answers it with replica_balancing
+    if (worker->batch_cnt > 0 && !env->is_replica_balancing && worker->batch[0]->node != client->node) {
+        ev_timer_stop(EV_A_ &worker->batch_timer);
+        na_event_batch_flush(EV_A_ worker);
+    }
+
+    worker->batch[worker->batch_cnt++] = client;
+
+    if (worker->batch_cnt >= env->batch_key_max) {
+        ev_timer_stop(EV_A_ &worker->batch_timer);
+        na_event_batch_flush(EV_A_ worker);
+    } else if (worker->batch_cnt == 1) {
+        ev_timer_set(&worker->batch_timer, env->batch_window_usec / 1000000., 0.);
+        ev_timer_start(EV_A_ &worker->batch_timer);
+    }
+}
+
+/**
+ * the first client of the batch sends the multi-key get for all of them.
+ */
+static void na_event_batch_flush (EV_P_ na_event_worker_t *worker)
+{
+    int cnt;
+    na_client_t *leader;
+
+    cnt               = worker->batch_cnt;
+    worker->batch_cnt = 0;
+    leader            = worker->batch[0];
+
+    leader->batch_next = NULL;
+    for (int i=cnt-1;i>0;--i) {
+        worker->batch[i]->batch_next = leader->batch_next;
+        leader->batch_next           = worker->batch[i];
+    }
+
+    atomic_fetch_add_explicit(&worker->batch_hist[na_batch_hist_index(cnt)], 1, memory_order_relaxed);
+
+    if (cnt > 1) {
+        leader->is_batch_leader = true;
+        if (!na_batch_request(leader)) {
+            // every client sends its own get
+            na_event_batch_abort(EV_A_ leader);
+        }
+    }
+
+    // an inline write may close the leader
+    na_event_state_switch(EV_A_ &leader->ts_watcher, leader, NA_EVENT_STATE_TARGET_WRITE);
+}
+
+/**
+ * the response of the leader is already split into srbuf of the clients.
+ */
+static void na_event_batch_deliver (EV_P_ na_client_t *leader)
+{
+    na_client_t *client, *next;
+
+    leader->is_batch_leader = false;
+    for (client=leader->batch_next;client!=NULL;client=next) {
+        next               = client->batch_next;
+        client->batch_next = NULL;
+
+        client->res_cnt               = client->req_cnt;
+        client->na_to_ts_time_begin   = leader->na_to_ts_time_begin;
+        client->na_to_ts_time_end     = leader->na_to_ts_time_end;
+        client->na_from_ts_time_begin = leader->na_from_ts_time_begin;
+        client->na_from_ts_time_end   = leader->na_from_ts_time_end;
+
+        if (client->is_collapse_leader) {
+            na_event_collapse_deliver(EV_A_ client);
+        }
+        // an inline write may close the client
+        na_event_state_switch(EV_A_ &client->c_watcher, client, NA_EVENT_STATE_CLIENT_WRITE);
+    }
+    leader->batch_next = NULL;
+}
+
+/**
+ * the multi-key get failed. every other client of the batch sends its own get.
+ */
+static void na_event_batch_abort (EV_P_ na_client_t *leader)
+{
+    na_client_t *client, *next;
+
+    leader->is_batch_leader = false;
+    for (client=leader->batch_next;client!=NULL;client=next) {
+        next               = client->batch_next;
+        client->batch_next = NULL;
+        client->srbufsize  = 0;
+        na_event_state_switch(EV_A_ &client->ts_watcher, client, NA_EVENT_STATE_TARGET_WRITE);
+    }
+    leader->batch_next = NULL;
+}
+
+static void na_event_batch_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_event_worker_t *worker;
+
+    worker = (na_event_worker_t *)w->data;
+
+    if (worker->batch_cnt > 0) {
+        na_event_batch_flush(EV_A_ worker);
+    }
+}
+
+/**
+ * insert the private barrier(noop or mn) after the framed requests.
+ */
+static void na_event_request_barrier (na_client_t *client)
+{
+    int rest, size;
+    const char *barrier;
+
+    barrier = na_memproto_barrier(client->cmd, &size);
+
+    if (client->crbufsize + size > client->request_bufsize) {
+        client->request_bufsize = client->crbufsize + size;
+        client->crbuf           = (char *)realloc(client->crbuf, client->request_bufsize + 1);
+    }
+
+    rest = client->crbufsize - client->crframed;
+    memmove(client->crbuf + client->crframed + size,
+            client->crbuf + client->crframed,
+            rest + 1);
+    memcpy(client->crbuf + client->crframed, barrier, size);
+    client->crframed  += size;
+    client->crbufsize += size;
+}
+
+/**
+ * the response is written and the client waits for the next request.
+ * pipelined requests left in the buffer are dispatched at once.
+ */
+static void na_event_request_finish (EV_P_ struct ev_io *w, na_client_t *client)
+{
+    int rest;
+    na_env_t *env;
+
+    env  = client->env;
+    rest = client->crbufsize - client->crframed;
+
+    client->crbufsize = client->crframed;
+    na_slow_query_gettime(env, &client->na_to_client_time_end);
+    na_slow_query_check(client);
+
+    if (rest > 0) {
+        memmove(client->crbuf, client->crbuf + client->crframed, rest);
+    } else {
+        client->request_bufsize = env->request_bufsize;
+    }
+    client->crbuf[rest]      = '\0';
+    client->crbufsize        = rest;
+    client->crframed         = 0;
+    client->twbufsize        = 0;
+    client->is_translated    = false;
+    client->cwbufsize        = 0;
+    client->srbufsize        = 0;
+    client->swbufsize        = 0;
+    client->response_bufsize = env->response_bufsize;
+    client->event_state      = NA_EVENT_STATE_CLIENT_READ;
+    client->req_cnt          = 0;
+    client->res_cnt          = 0;
+    na_memproto_res_parser_init(&client->res_parser);
+
+    // replies to noreply requests are discarded up to the barrier
+    if (client->is_noreply) {
+        client->noreply_mn_cnt++;
+    }
+    client->is_noreply = false;
+
+    if (rest == 0 && na_event_worker_client_donate(EV_A_ client)) {
+        return; // idle client is offered to other worker
+    }
+    na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_CLIENT_READ);
+
+    if (rest > 0) {
+        na_event_request_dispatch(EV_A_ &client->c_watcher, client);
+    }
+}
+
+static void na_event_client_watch (EV_P_ na_client_t *client)
+{
+    ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
+    if (client->env->is_persistent_watcher) {
+        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_READ);
+        ev_io_start(EV_A_ &client->ts_watcher);
+    } else if (client->noreply_mn_cnt > 0) {
+        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_READ);
+        ev_io_start(EV_A_ &client->ts_watcher);
+    } else {
+        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
+    }
+    ev_io_start(EV_A_ &client->c_watcher);
+}
+
+static bool na_event_model_is_supported (na_event_model_t model)
+{
+    switch (model) {
+    case NA_EVENT_MODEL_IOURING:
+#ifdef NA_EVENT_HAVE_IOURING
+        return (ev_supported_backends() & EVBACKEND_IOURING) != 0;
+#else
+        return false;
+#endif
+    default:
+        return true;
+    }
 }
 
 static struct ev_loop *na_event_loop_create(na_event_model_t model)
@@ -70,6 +1384,16 @@ static struct ev_loop *na_event_loop_create(na_event_model_t model)
     case NA_EVENT_MODEL_KQUEUE:
         loop = ev_loop_new(EVBACKEND_KQUEUE);
         break;
+    case NA_EVENT_MODEL_IOURING:
+#ifdef NA_EVENT_HAVE_IOURING
+        loop = ev_loop_new(EVBACKEND_IOURING);
+#else
+        loop = NULL;
+#endif
+        if (loop == NULL) {
+            loop = ev_loop_new(EVBACKEND_EPOLL);
+        }
+        break;
     default:
         // no through
         assert(false);
@@ -78,48 +1402,58 @@ static struct ev_loop *na_event_loop_create(na_event_model_t model)
     return loop;
 }
 
-static int na_client_assign (na_env_t *env)
+/**
+ * assign up to n free slots of the client pool,
+ * scanning once from a random position.
+ */
+static int na_client_assign_batch (na_env_t *env, int *curs, int n)
 {
-    int ri;
+    int ri, idx, cnt;
 
-    ri = rand() % env->client_pool_max;
-    pthread_mutex_lock(&ClientPool[ri].lock_use);
-    if (ClientPool[ri].is_used == false) {
-        ClientPool[ri].is_used = true;
-        pthread_mutex_unlock(&ClientPool[ri].lock_use);
-        return ri;
-    }
-    pthread_mutex_unlock(&ClientPool[ri].lock_use);
+    ri  = rand() % env->client_pool_max;
+    cnt = 0;
 
-    switch (rand() % 2) {
-    case 0:
-        for (int i=env->client_pool_max-1;i>=0;--i) {
-            pthread_mutex_lock(&ClientPool[i].lock_use);
-            if (ClientPool[i].is_used == false) {
-                ClientPool[i].is_used = true;
-                pthread_mutex_unlock(&ClientPool[i].lock_use);
-                return i;
-            }
-            pthread_mutex_unlock(&ClientPool[i].lock_use);
-        }
-        break;
-    default:
-        for (int i=0;i<env->client_pool_max;++i) {
-            pthread_mutex_lock(&ClientPool[i].lock_use);
-            if (ClientPool[i].is_used == false) {
-                ClientPool[i].is_used = true;
-                pthread_mutex_unlock(&ClientPool[i].lock_use);
-                return i;
-            }
-            pthread_mutex_unlock(&ClientPool[i].lock_use);
+    for (int i=0;i<env->client_pool_max && cnt<n;++i) {
+        idx = (ri + i) % env->client_pool_max;
+        pthread_mutex_lock(&ClientPool[idx].lock_use);
+        if (ClientPool[idx].is_used == false) {
+            ClientPool[idx].is_used = true;
+            curs[cnt++] = idx;
         }
-        break;
+        pthread_mutex_unlock(&ClientPool[idx].lock_use);
     }
-    return -1;
+
+    return cnt;
+}
+
+static void na_client_release (na_client_t *client)
+{
+    pthread_mutex_lock(&client->lock_use);
+    client->is_used = false;
+    pthread_mutex_unlock(&client->lock_use);
 }
 
 static void na_client_close (EV_P_ na_client_t *client, na_env_t *env)
 {
+    int conn;
+    na_event_worker_t *worker;
+
+    if (client->is_batch_leader) {
+        na_event_batch_abort(EV_A_ client);
+    }
+    if (client->is_collapse_leader) {
+        na_event_collapse_abort(EV_A_ client);
+    }
+    if (client->fanout != NULL) {
+        na_event_fanout_release(EV_A_ client);
+    }
+    na_event_hedge_cancel(EV_A_ client);
+    na_event_balance_end(client, false);
+    na_event_noreply_abandon(client);
+
+    worker = client->worker;
+    client->worker = NULL;
+
     close(client->cfd);
     ev_io_stop(EV_A_ &client->c_watcher);
     ev_io_stop(EV_A_ &client->ts_watcher);
@@ -138,43 +1472,69 @@ static void na_client_close (EV_P_ na_client_t *client, na_env_t *env)
     pthread_mutex_unlock(&env->lock_connpool);
 
     if (client->is_use_client_pool) {
-        pthread_mutex_lock(&client->lock_use);
-        client->is_used = false;
-        pthread_mutex_unlock(&client->lock_use);
+        na_client_release(client);
     } else {
         NA_FREE(client->crbuf);
         NA_FREE(client->srbuf);
+        NA_FREE(client->twbuf);
         NA_FREE(client);
     }
 
-    pthread_mutex_lock(&env->lock_current_conn);
-    if (env->current_conn > 0) {
-        --env->current_conn;
-        if (GracefulPhase == NA_GRACEFUL_PHASE_STOP_ACCEPT && env->current_conn == 0) {
+    if (worker != NULL) {
+        na_event_worker_client_detach(worker);
+    }
+
+    // current_conn may be reset by the health check, so it never goes below zero
+    conn = atomic_load_explicit(&env->current_conn, memory_order_relaxed);
+    while (conn > 0 &&
+           !atomic_compare_exchange_weak_explicit(&env->current_conn, &conn, conn - 1,
+                                                  memory_order_acq_rel, memory_order_relaxed))
+        ;
+
+    if (conn == 1 && GracefulPhase == NA_GRACEFUL_PHASE_STOP_ACCEPT) {
+        pthread_mutex_lock(&env->lock_current_conn);
+        if (GracefulPhase == NA_GRACEFUL_PHASE_STOP_ACCEPT && atomic_load(&env->current_conn) == 0) {
             GracefulPhase = NA_GRACEFUL_PHASE_COMPLETED;
         }
+        pthread_mutex_unlock(&env->lock_current_conn);
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
 }
 
 static void na_target_server_callback (EV_P_ struct ev_io *w, int revents)
 {
-    int cfd, tsfd, size;
+    int tsfd, size, wbufsize;
+    char *wbuf;
     na_client_t *client;
     na_env_t *env;
+    na_topology_t *topology;
 
     tsfd   = w->fd;
     client = (na_client_t *)w->data;
     env    = client->env;
-    cfd    = client->cfd;
 
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if ((client->is_refused_active != env->is_refused_active) || env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
+    if ((revents & EV_READ) && client->noreply_mn_cnt > 0) {
+        // replies to noreply requests come before the response of the next request
+        if (!na_event_noreply_discard(EV_A_ w, client)) {
+            goto finally; // not ready yet or request fail
+        } else if (client->event_state != NA_EVENT_STATE_TARGET_READ) {
+            ev_io_stop(EV_A_ w);
+            goto finally;
+        }
+    }
+
+    if ((revents & EV_READ) && client->event_state != NA_EVENT_STATE_TARGET_READ &&
+        env->is_persistent_watcher)
+    {
+        // nothing is expected from the target server, park until the next request
+        ev_io_stop(EV_A_ w);
+        goto finally;
+    }
+
+    topology = na_topology_current(env);
+    if ((client->topology_epoch != topology->epoch) || topology->is_refused_accept) {
         NA_EVENT_FAIL(NA_ERROR_INVALID_CONNPOOL, EV_A, w, client, env);
         goto finally; // request fail
     }
-    pthread_rwlock_unlock(&env->lock_refused);
 
     if (env->loop_max > 0 && client->loop_cnt++ > env->loop_max) {
         NA_EVENT_FAIL(NA_ERROR_OUTOF_LOOP, EV_A, w, client, env);
@@ -211,66 +1571,98 @@ static void na_target_server_callback (EV_P_ struct ev_io *w, int revents)
         client->srbufsize                += size;
         client->srbuf[client->srbufsize]  = '\0';
 
-        if (client->cmd == NA_MEMPROTO_CMD_GET) {
-            client->res_cnt = na_memproto_count_response_get(client->srbuf, client->srbufsize);
+        if (client->cmd == NA_MEMPROTO_CMD_GET || client->res_parser.kind_cnt > 0 || client->is_translated) {
+            if (client->cmd == NA_MEMPROTO_CMD_BINARY ||
+                (client->is_translated && env->upstream_protocol == NA_UPSTREAM_PROTOCOL_BINARY))
+            {
+                client->res_cnt = na_memproto_bin_res_parse(&client->res_parser, client->srbuf, client->srbufsize);
+            } else {
+                client->res_cnt = na_memproto_res_parse(&client->res_parser, client->srbuf, client->srbufsize);
+            }
+            if (client->res_cnt < 0) {
+                NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, w, client, env);
+                goto finally; // request fail
+            }
             if (client->res_cnt >= client->req_cnt) {
-                client->event_state = NA_EVENT_STATE_CLIENT_WRITE;
-                na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
+                if (client->res_parser.is_barrier &&
+                    !na_memproto_barrier_strip(client->cmd, client->srbuf, &client->srbufsize))
+                {
+                    NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, w, client, env);
+                    goto finally; // request fail
+                }
+                if (client->is_translated && !na_translate_response(client, env->upstream_protocol)) {
+                    NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, w, client, env);
+                    goto finally; // request fail
+                }
+                if (client->is_batch_leader && !na_batch_response(client)) {
+                    NA_EVENT_FAIL(NA_ERROR_INVALID_RESPONSE, EV_A, w, client, env);
+                    goto finally; // request fail
+                }
+                na_event_hedge_cancel(EV_A_ client);
+                na_event_balance_end(client, true);
                 na_slow_query_gettime(env, &client->na_from_ts_time_end);
+                if (client->is_batch_leader) {
+                    na_event_batch_deliver(EV_A_ client);
+                }
+                if (client->is_collapse_leader) {
+                    na_event_collapse_deliver(EV_A_ client);
+                }
+                na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_CLIENT_WRITE);
+                goto finally;
+            }
+            // the response of a barrier must not reach the client
+            // and leaders keep the whole response for other clients.
+            // a hedged get is not streamed because either response may win
+            if (env->is_response_streaming && !client->is_translated &&
+                !client->is_collapse_leader && !client->is_batch_leader &&
+                !ev_is_active(&client->hedge_timer) && client->hedge == NULL &&
+                client->cmd != NA_MEMPROTO_CMD_BINARY && !client->res_parser.is_barrier)
+            {
+                na_event_response_stream(EV_A_ w, client);
                 goto finally;
             }
         } else if (client->srbufsize > 2 &&
                    client->srbuf[client->srbufsize - 2] == '\r' &&
                    client->srbuf[client->srbufsize - 1] == '\n')
         {
-            client->event_state = NA_EVENT_STATE_CLIENT_WRITE;
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
+            na_event_balance_end(client, true);
             na_slow_query_gettime(env, &client->na_from_ts_time_end);
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_CLIENT_WRITE);
         }
 
     } else if (revents & EV_WRITE) {
 
+        if (env->is_replica_balancing && client->balance_connpool == NULL) {
+            client->balance_connpool = client->connpool;
+            client->balance_begin    = na_balance_start(client->connpool);
+        }
+
         if ((client->na_to_ts_time_begin.tv_sec == 0) &&
             (client->na_to_ts_time_begin.tv_nsec == 0))
         {
             na_slow_query_gettime(env, &client->na_to_ts_time_begin);
         }
 
+        if (client->is_translated || client->is_batch_leader) {
+            wbuf     = client->twbuf;
+            wbufsize = client->twbufsize;
+        } else {
+            wbuf     = client->crbuf;
+            wbufsize = client->crframed;
+        }
+
         size = write(tsfd,
-                     client->crbuf + client->swbufsize,
-                     client->crbufsize - client->swbufsize);
+                     wbuf + client->swbufsize,
+                     wbufsize - client->swbufsize);
 
         if (size == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                goto finally; // not ready yet
-            } else if (client->is_use_connpool) {
-                int i = client->cur_pool;
-                na_server_t *server;
-                pthread_rwlock_rdlock(&env->lock_refused);
-                if (env->is_use_backup) {
-                    server = env->is_refused_active ? &env->backup_server : &env->target_server;
-                } else {
-                    server = &env->target_server;
-                }
-                pthread_rwlock_unlock(&env->lock_refused);
-                pthread_mutex_lock(&env->lock_connpool);
-                if (client->connpool->fd_pool[i] > 0) {
-                    close(client->connpool->fd_pool[i]);
-                }
-                client->connpool->fd_pool[i] = na_target_server_tcpsock_init();
-                na_target_server_tcpsock_setup(client->connpool->fd_pool[i], true);
-                if (client->connpool->fd_pool[i] <= 0) {
-                    pthread_mutex_unlock(&env->lock_connpool);
-                    NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
-                }
-
-                if (!na_server_connect(client->connpool->fd_pool[i], &server->addr)) {
-                    if (errno != EINPROGRESS && errno != EALREADY) {
-                        pthread_mutex_unlock(&env->lock_connpool);
-                        NA_DIE_WITH_ERROR(env, NA_ERROR_CONNECTION_FAILED);
-                    }
-                }
-                pthread_mutex_unlock(&env->lock_connpool);
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                na_event_write_wait(EV_A_ w, client);
+                goto finally; // not ready yet
+            } else if (client->is_use_connpool) {
+                na_server_t *server;
+                server = client->node == 0 ? topology->server : &env->target_servers[client->node];
+                na_event_connpool_reconnect(env, client->connpool, client->cur_pool, server);
             }
 
             if (errno == EPIPE) {
@@ -283,12 +1675,26 @@ static void na_target_server_callback (EV_P_ struct ev_io *w, int revents)
 
         client->swbufsize += size;
 
-        if (client->swbufsize < client->crbufsize) {
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_WRITE);
+        if (client->swbufsize < wbufsize) {
+            na_event_write_wait(EV_A_ w, client);
+        } else if (client->req_remain > 0) {
+            // the buffer is reused for the rest of the streamed request
+            client->crbufsize = 0;
+            client->crframed  = 0;
+            client->swbufsize = 0;
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_CLIENT_READ);
+        } else if (client->is_noreply) {
+            // only noreply requests are forwarded, the client goes back to reading at once
+            if (client->worker != NULL) {
+                atomic_fetch_add_explicit(&client->worker->noreply_cnt, 1, memory_order_relaxed);
+            }
+            na_event_balance_end(client, false);
+            na_slow_query_gettime(env, &client->na_to_ts_time_end);
+            na_event_request_finish(EV_A_ w, client);
         } else {
-            client->event_state = NA_EVENT_STATE_TARGET_READ;
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_READ);
             na_slow_query_gettime(env, &client->na_to_ts_time_end);
+            na_event_hedge_arm(EV_A_ client);
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_READ);
         }
         goto finally;
     }
@@ -299,22 +1705,28 @@ static void na_target_server_callback (EV_P_ struct ev_io *w, int revents)
 
 static void na_client_callback(EV_P_ struct ev_io *w, int revents)
 {
-    int cfd, tsfd, size;
+    int cfd, size, len;
     na_client_t *client;
     na_env_t *env;
+    na_topology_t *topology;
 
     cfd    = w->fd;
     client = (na_client_t *)w->data;
     env    = client->env;
-    tsfd   = client->tsfd;
 
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if ((client->is_refused_active != env->is_refused_active) || env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
+    if (env->is_persistent_watcher &&
+        (revents & EV_READ) && client->event_state != NA_EVENT_STATE_CLIENT_READ)
+    {
+        // pipelined request, park until the response is written
+        ev_io_stop(EV_A_ w);
+        goto finally;
+    }
+
+    topology = na_topology_current(env);
+    if ((client->topology_epoch != topology->epoch) || topology->is_refused_accept) {
         NA_EVENT_FAIL(NA_ERROR_INVALID_CONNPOOL, EV_A, w, client, env);
         goto finally; // request fail
     }
-    pthread_rwlock_unlock(&env->lock_refused);
 
     if (env->loop_max > 0 && client->loop_cnt++ > env->loop_max) {
         NA_EVENT_FAIL(NA_ERROR_OUTOF_LOOP, EV_A, w, client, env);
@@ -323,16 +1735,19 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
 
     if (revents & EV_READ) {
 
-        if (client->crbufsize >= client->request_bufsize) {
+        if (client->req_remain == 0 && client->crbufsize >= client->request_bufsize) {
             size_t es;
             es = (client->request_bufsize - 1) * 2;
             client->crbuf = (char *)realloc(client->crbuf, es + 1);
             client->request_bufsize = es;
         }
 
-        size = read(cfd,
-                    client->crbuf + client->crbufsize,
-                    client->request_bufsize - client->crbufsize);
+        len = client->request_bufsize - client->crbufsize;
+        if (client->req_remain > 0 && client->req_remain < len) {
+            len = client->req_remain;
+        }
+
+        size = read(cfd, client->crbuf + client->crbufsize, len);
 
         if (size == 0) {
             na_event_stop(EV_A_ w, client, env);
@@ -348,31 +1763,18 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
         client->crbufsize                += size;
         client->crbuf[client->crbufsize]  = '\0';
 
-        client->cmd = na_memproto_detect_command(client->crbuf);
-
-        if (client->cmd == NA_MEMPROTO_CMD_QUIT) {
-            na_event_stop(EV_A_ w, client, env);
-            goto finally; // request success
-        } else if (client->cmd == NA_MEMPROTO_CMD_GET || client->cmd == NA_MEMPROTO_CMD_SET) {
-            client->req_cnt = na_memproto_count_request_get(client->crbuf, client->crbufsize);
-        }
-
-        if (client->crbufsize < 2) {
-            goto finally; // not ready yet
-        } else if (client->crbuf[client->crbufsize - 2] == '\r' &&
-                   client->crbuf[client->crbufsize - 1] == '\n')
-        {
-            if (client->cmd == NA_MEMPROTO_CMD_UNKNOWN) {
-                na_event_stop(EV_A_ w, client, env);
-                goto finally; // request fail
-            } else if (client->cmd == NA_MEMPROTO_CMD_SET && client->req_cnt < 2) {
-                goto finally; // not ready yet
+        if (client->req_remain > 0) {
+            client->req_remain -= size;
+            client->crframed    = client->crbufsize;
+            if (client->req_remain == 0 && client->is_noreply) {
+                na_event_request_barrier(client);
             }
-            client->event_state = NA_EVENT_STATE_TARGET_WRITE;
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_WRITE);
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_WRITE);
             goto finally;
         }
 
+        na_event_request_dispatch(EV_A_ w, client);
+        goto finally;
     } else if (revents & EV_WRITE) {
 
         if ((client->na_to_client_time_begin.tv_sec == 0) &&
@@ -387,6 +1789,7 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
 
         if (size == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                na_event_write_wait(EV_A_ w, client);
                 goto finally; // not ready yet
             }
             if (errno == EPIPE) {
@@ -399,22 +1802,15 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
 
         client->cwbufsize += size;
         if (client->cwbufsize < client->srbufsize) {
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
+            na_event_write_wait(EV_A_ w, client);
+            goto finally;
+        } else if (na_event_response_is_partial(client)) {
+            // the rest of the streamed response is not received yet
+            na_event_response_compact(client);
+            na_event_state_switch(EV_A_ w, client, NA_EVENT_STATE_TARGET_READ);
             goto finally;
         } else {
-            na_slow_query_gettime(env, &client->na_to_client_time_end);
-            na_slow_query_check(client);
-
-            client->crbufsize        = 0;
-            client->cwbufsize        = 0;
-            client->srbufsize        = 0;
-            client->swbufsize        = 0;
-            client->request_bufsize  = env->request_bufsize;
-            client->response_bufsize = env->response_bufsize;
-            client->event_state      = NA_EVENT_STATE_CLIENT_READ;
-            client->req_cnt          = 0;
-            client->res_cnt          = 0;
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_READ);
+            na_event_request_finish(EV_A_ w, client);
             goto finally;
         }
     }
@@ -423,237 +1819,566 @@ finally:
     ; // do nothing
 }
 
-void na_front_server_callback (EV_P_ struct ev_io *w, int revents)
+static void na_target_server_release (na_env_t *env, na_connpool_t *connpool, int cur_pool, int tsfd)
 {
-    int fsfd, cfd, tsfd, cur_pool, cur_cli;
-    na_env_t *env;
+    if (cur_pool == -1) {
+        close(tsfd);
+    } else {
+        pthread_mutex_lock(&env->lock_connpool);
+        connpool->mark[cur_pool] = 0;
+        pthread_mutex_unlock(&env->lock_connpool);
+    }
+}
+
+/**
+ * accept up to accept_batch_max connections per wakeup.
+ * upstream connections and client slots are assigned for the whole batch.
+ */
+static int na_front_server_accept (na_env_t *env, int fsfd, na_client_t **clients)
+{
+    int cnt, room, accepted, leased, assigned, cur_pool, cur_cli, conn, conn_max;
+    int cfds[env->accept_batch_max];
+    int tsfds[env->accept_batch_max];
+    int curs_pool[env->accept_batch_max];
+    int curs_cli[env->accept_batch_max];
     na_client_t *client;
     na_connpool_t *connpool;
     na_server_t *server;
+    na_topology_t *topology;
 
-    fsfd     = w->fd;
-    env      = (na_env_t *)w->data;
-    cfd      = -1;
-    tsfd     = -1;
-    cur_pool = -1;
-    cur_cli  = -1;
-
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if (env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
-        goto finally;
+    topology = na_topology_current(env);
+    if (topology->is_refused_accept) {
+        return 0;
     }
-    pthread_rwlock_unlock(&env->lock_refused);
 
-    pthread_mutex_lock(&env->lock_current_conn);
-    if (env->current_conn >= env->conn_max) {
-        pthread_mutex_unlock(&env->lock_current_conn);
-        goto finally;
+    room = env->conn_max - atomic_load_explicit(&env->current_conn, memory_order_relaxed);
+
+    if (room <= 0) {
+        return 0;
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
 
-    pthread_rwlock_rdlock(&env->lock_refused);
-    connpool = na_connpool_select(env);
-    if (env->is_use_backup) {
-        server = env->is_refused_active ? &env->backup_server : &env->target_server;
-    } else {
-        server = &env->target_server;
+    accepted = na_server_accept_batch(fsfd, cfds, room < env->accept_batch_max ? room : env->accept_batch_max);
+    if (accepted <= 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
+        }
+        return 0;
     }
-    pthread_rwlock_unlock(&env->lock_refused);
 
-    if (!na_connpool_assign(env, connpool, &cur_pool, &tsfd, server)) {
-        tsfd = na_target_server_tcpsock_init();
-        if (tsfd < 0) {
+    connpool = topology->connpool;
+    server   = topology->server;
+
+    leased = na_connpool_assign_batch(env, connpool, accepted, curs_pool, tsfds, server);
+    for (int i=leased;i<accepted;++i) {
+        curs_pool[i] = -1;
+        tsfds[i]     = na_target_server_tcpsock_init();
+        if (tsfds[i] < 0) {
             NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
-            goto finally;
+            continue;
         }
-        na_target_server_tcpsock_setup(tsfd, true);
+        na_target_server_tcpsock_setup(tsfds[i], true);
 
-        if (!na_server_connect(tsfd, &server->addr)) {
+        if (!na_server_connect(tsfds[i], &server->addr)) {
             if (errno != EINPROGRESS && errno != EALREADY) {
-                close(tsfd);
+                close(tsfds[i]);
+                tsfds[i] = -1;
                 NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_CONNECTION_FAILED);
-                goto finally;
             }
         }
     }
 
-    if ((cfd = na_server_accept(fsfd)) < 0) {
-        if (cur_pool == -1) {
-            close(tsfd);
-        } else {
-            pthread_mutex_lock(&env->lock_connpool);
-            connpool->mark[cur_pool] = 0;
-            pthread_mutex_unlock(&env->lock_connpool);
-        }
-        NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
-        goto finally;
-    }
-
-    na_set_nonblock(cfd);
+    assigned = na_client_assign_batch(env, curs_cli, accepted);
 
-    cur_cli = na_client_assign(env);
+    cnt = 0;
+    for (int i=0;i<accepted;++i) {
+        cur_pool = curs_pool[i];
+        cur_cli  = i < assigned ? curs_cli[i] : -1;
 
-    if (cur_cli >= 0) {
-        client = &ClientPool[cur_cli];
-        if (client->tsfd > 0) {
-            close(client->tsfd);
-        }
-    } else {
-        client = (na_client_t *)malloc(sizeof(na_client_t));
-        if (client == NULL) {
-            close(cfd);
-            if (cur_pool == -1) {
-                close(tsfd);
-            } else {
-                pthread_mutex_lock(&env->lock_connpool);
-                connpool->mark[cur_pool] = 0;
-                pthread_mutex_unlock(&env->lock_connpool);
+        if (tsfds[i] < 0) {
+            close(cfds[i]);
+            if (cur_cli != -1) {
+                na_client_release(&ClientPool[cur_cli]);
             }
-            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
-            goto finally;
+            continue;
         }
-        memset(client, 0, sizeof(*client));
-        client->crbuf = (char *)malloc(env->request_bufsize + 1);
-        client->srbuf = (char *)malloc(env->response_bufsize + 1);
-        if (client->crbuf == NULL ||
-            client->srbuf == NULL) {
-            NA_FREE(client->crbuf);
-            NA_FREE(client->srbuf);
-            NA_FREE(client);
-            close(cfd);
-            if (cur_pool == -1) {
-                close(tsfd);
-            } else {
-                pthread_mutex_lock(&env->lock_connpool);
-                connpool->mark[cur_pool] = 0;
-                pthread_mutex_unlock(&env->lock_connpool);
+
+        if (cur_cli >= 0) {
+            client = &ClientPool[cur_cli];
+            if (client->tsfd > 0) {
+                close(client->tsfd);
+            }
+        } else {
+            client = (na_client_t *)malloc(sizeof(na_client_t));
+            if (client == NULL) {
+                close(cfds[i]);
+                na_target_server_release(env, connpool, cur_pool, tsfds[i]);
+                NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+                continue;
+            }
+            memset(client, 0, sizeof(*client));
+            client->crbuf = (char *)malloc(env->request_bufsize + 1);
+            client->srbuf = (char *)malloc(env->response_bufsize + 1);
+            if (client->crbuf == NULL ||
+                client->srbuf == NULL) {
+                NA_FREE(client->crbuf);
+                NA_FREE(client->srbuf);
+                NA_FREE(client);
+                close(cfds[i]);
+                na_target_server_release(env, connpool, cur_pool, tsfds[i]);
+                NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+                continue;
             }
-            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
-            goto finally;
         }
+
+        client->cfd                = cfds[i];
+        client->tsfd               = tsfds[i];
+        client->env                = env;
+        client->c_watcher.data     = client;
+        client->ts_watcher.data    = client;
+        client->topology_epoch     = topology->epoch;
+        client->is_use_connpool    = cur_pool != -1 ? true : false;
+        client->is_use_client_pool = cur_cli  != -1 ? true : false;
+        client->cur_pool           = cur_pool;
+        client->crbufsize          = 0;
+        client->crframed           = 0;
+        client->twbufsize          = 0;
+        client->is_translated      = false;
+        client->is_noreply         = false;
+        client->noreply_mn_cnt     = 0;
+        client->noreply_match      = 0;
+        client->is_collapse_leader = false;
+        client->collapse_next      = NULL;
+        client->is_batch_leader    = false;
+        client->batch_next         = NULL;
+        client->fanout             = NULL;
+        client->hedge              = NULL;
+        client->balance_connpool   = NULL;
+        client->hedge_timer.data   = client;
+        ev_timer_init(&client->hedge_timer, na_event_hedge_timer_callback, 0., 0.);
+        client->cwbufsize          = 0;
+        client->srbufsize          = 0;
+        client->swbufsize          = 0;
+        client->request_bufsize    = env->request_bufsize;
+        client->response_bufsize   = env->response_bufsize;
+        client->event_state        = NA_EVENT_STATE_CLIENT_READ;
+        client->req_cnt            = 0;
+        client->res_cnt            = 0;
+        client->req_remain         = 0;
+        na_memproto_res_parser_init(&client->res_parser);
+        client->loop_cnt           = 0;
+        client->cmd                = NA_MEMPROTO_CMD_NOT_DETECTED;
+        client->connpool           = connpool;
+        client->node               = 0;
+        client->worker             = NULL;
+        memset(&client->na_from_ts_time_begin,   0, sizeof(struct timespec));
+        memset(&client->na_from_ts_time_end,     0, sizeof(struct timespec));
+        memset(&client->na_to_ts_time_begin,     0, sizeof(struct timespec));
+        memset(&client->na_to_ts_time_end,       0, sizeof(struct timespec));
+        memset(&client->na_to_client_time_begin, 0, sizeof(struct timespec));
+        memset(&client->na_to_client_time_end,   0, sizeof(struct timespec));
+
+        clients[cnt++] = client;
     }
 
-    client->cfd                = cfd;
-    client->tsfd               = tsfd;
-    client->env                = env;
-    client->c_watcher.data     = client;
-    client->ts_watcher.data    = client;
-    pthread_rwlock_rdlock(&env->lock_refused);
-    client->is_refused_active  = env->is_refused_active;
-    pthread_rwlock_unlock(&env->lock_refused);
-    client->is_use_connpool    = cur_pool != -1 ? true : false;
-    client->is_use_client_pool = cur_cli  != -1 ? true : false;
-    client->cur_pool           = cur_pool;
-    client->crbufsize          = 0;
-    client->cwbufsize          = 0;
-    client->srbufsize          = 0;
-    client->swbufsize          = 0;
-    client->request_bufsize    = env->request_bufsize;
-    client->response_bufsize   = env->response_bufsize;
-    client->event_state        = NA_EVENT_STATE_CLIENT_READ;
-    client->req_cnt            = 0;
-    client->res_cnt            = 0;
-    client->loop_cnt           = 0;
-    client->cmd                = NA_MEMPROTO_CMD_NOT_DETECTED;
-    client->connpool           = connpool;
-    memset(&client->na_from_ts_time_begin,   0, sizeof(struct timespec));
-    memset(&client->na_from_ts_time_end,     0, sizeof(struct timespec));
-    memset(&client->na_to_ts_time_begin,     0, sizeof(struct timespec));
-    memset(&client->na_to_ts_time_end,       0, sizeof(struct timespec));
-    memset(&client->na_to_client_time_begin, 0, sizeof(struct timespec));
-    memset(&client->na_to_client_time_end,   0, sizeof(struct timespec));
-
-    pthread_mutex_lock(&env->lock_current_conn);
-    ++env->current_conn;
-
-    if (env->current_conn > env->current_conn_max) {
-        env->current_conn_max = env->current_conn;
-    }
-    pthread_mutex_unlock(&env->lock_current_conn);
-
-    if (!na_is_worker_busy(env)) {
-        if (!na_event_queue_push(EventQueue, client)) {
+    conn     = atomic_fetch_add_explicit(&env->current_conn, cnt, memory_order_relaxed) + cnt;
+    conn_max = atomic_load_explicit(&env->current_conn_max, memory_order_relaxed);
+    while (conn > conn_max &&
+           !atomic_compare_exchange_weak_explicit(&env->current_conn_max, &conn_max, conn,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    return cnt;
+}
+
+static void na_front_server_callback (EV_P_ struct ev_io *w, int revents)
+{
+    int fsfd, cnt;
+    na_env_t *env;
+    na_client_t *client;
+    na_event_worker_t *worker;
+
+    fsfd = w->fd;
+    env  = (na_env_t *)w->data;
+
+    na_client_t *clients[env->accept_batch_max];
+
+    cnt = na_front_server_accept(env, fsfd, clients);
+
+    for (int i=0;i<cnt;++i) {
+        client = clients[i];
+        worker = &env->workers[na_event_worker_select(env)];
+        if (na_event_queue_push(worker->queue, client)) {
+            ev_async_send(worker->loop, &worker->async_watcher);
+        } else {
             NA_ERROR_OUTPUT(env, "Too Many Connections!");
-            ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-            ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-            ev_io_start(EV_A_ &client->c_watcher);
+            na_event_client_watch(EV_A_ client);
         }
-    } else {
-        ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-        ev_io_start(EV_A_ &client->c_watcher);
     }
 
-finally:
-    pthread_mutex_lock(&env->lock_current_conn);
     if (GracefulPhase == NA_GRACEFUL_PHASE_ENABLED) {
-        ev_io_set(&env->fs_watcher, fsfd, EV_NONE);
-        GracefulPhase = NA_GRACEFUL_PHASE_STOP_ACCEPT;
+        pthread_mutex_lock(&env->lock_current_conn);
+        if (GracefulPhase == NA_GRACEFUL_PHASE_ENABLED) {
+            ev_io_set(&env->fs_watcher, fsfd, EV_NONE);
+            GracefulPhase = NA_GRACEFUL_PHASE_STOP_ACCEPT;
+        }
+        pthread_mutex_unlock(&env->lock_current_conn);
+    }
+
+}
+
+/**
+ * accept callback of the per-worker listener in reuseport mode.
+ * the kernel has already balanced the connection onto this worker.
+ */
+static void na_front_server_reuseport_callback (EV_P_ struct ev_io *w, int revents)
+{
+    int cnt;
+    na_env_t *env;
+    na_event_worker_t *worker;
+
+    worker = (na_event_worker_t *)w->data;
+    env    = worker->env;
+
+    na_client_t *clients[env->accept_batch_max];
+
+    cnt = na_front_server_accept(env, w->fd, clients);
+
+    for (int i=0;i<cnt;++i) {
+        na_event_worker_client_enter(EV_A_ worker, clients[i]);
+    }
+
+    if (GracefulPhase != NA_GRACEFUL_PHASE_DISABLED) {
+        ev_io_stop(EV_A_ w);
+        pthread_mutex_lock(&env->lock_current_conn);
+        if (GracefulPhase == NA_GRACEFUL_PHASE_ENABLED) {
+            GracefulPhase = NA_GRACEFUL_PHASE_STOP_ACCEPT;
+        }
+        pthread_mutex_unlock(&env->lock_current_conn);
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
+}
+
+bool na_is_worker_busy (na_env_t *env, int tid)
+{
+    uint64_t bits;
+    bits = atomic_load_explicit(&env->worker_busy_map[tid / 64].bits, memory_order_relaxed);
+    return (bits & (1ULL << (tid % 64))) != 0;
+}
 
+static void na_event_worker_busy_set(na_env_t *env, int tid, bool is_busy)
+{
+    if (is_busy) {
+        atomic_fetch_or_explicit(&env->worker_busy_map[tid / 64].bits, 1ULL << (tid % 64), memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit(&env->worker_busy_map[tid / 64].bits, ~(1ULL << (tid % 64)), memory_order_relaxed);
+    }
 }
 
-static bool na_is_worker_busy(na_env_t *env)
+/**
+ * Prefer a worker serving no connection at all,
+ * otherwise hand connections out in round-robin.
+ * This is called from the acceptor thread only.
+ */
+static int na_event_worker_select(na_env_t *env)
 {
-    int count_is_worker_busy = 0;
+    static int tid_rr = 0;
+    int tid;
+
     for (int i=0;i<env->worker_max;++i) {
-        pthread_rwlock_rdlock(&env->lock_worker_busy[i]);
-        if (env->is_worker_busy[i]) {
-            ++count_is_worker_busy;
+        tid = (tid_rr + i) % env->worker_max;
+        if (!na_is_worker_busy(env, tid)) {
+            tid_rr = (tid + 1) % env->worker_max;
+            return tid;
         }
-        pthread_rwlock_unlock(&env->lock_worker_busy[i]);
     }
 
-    if (count_is_worker_busy == env->worker_max) {
-        return true;
+    tid    = tid_rr;
+    tid_rr = (tid_rr + 1) % env->worker_max;
+
+    return tid;
+}
+
+static void na_event_worker_client_start(EV_P_ na_event_worker_t *worker, na_client_t *client)
+{
+    client->worker = worker;
+    if (worker->conn_cnt++ == 0) {
+        na_event_worker_busy_set(worker->env, worker->id, true);
+    }
+    na_event_client_watch(EV_A_ client);
+}
+
+static void na_event_worker_client_detach(na_event_worker_t *worker)
+{
+    if (--worker->conn_cnt == 0) {
+        na_event_worker_busy_set(worker->env, worker->id, false);
     }
+}
 
-    return false;
+/**
+ * a client newly handed to the worker. with work-stealing
+ * it waits in the deque until the end of the current loop iteration
+ * so that an idle worker can take it while this one is saturated.
+ */
+static void na_event_worker_client_enter(EV_P_ na_event_worker_t *worker, na_client_t *client)
+{
+    if (worker->env->is_work_stealing && na_event_worker_offer(worker, client)) {
+        return;
+    }
+    na_event_worker_client_start(EV_A_ worker, client);
 }
 
-static void *na_event_observer(void *args)
+/**
+ * offer a client which is idle between requests to the thief
+ * while the worker is saturated. this is called after
+ * the response is written and watchers of the client are not needed.
+ */
+static bool na_event_worker_client_donate(EV_P_ na_client_t *client)
+{
+    na_event_worker_t *worker;
+
+    worker = client->worker;
+
+    if (worker == NULL || worker->thief < 0) {
+        return false;
+    }
+
+    ev_io_stop(EV_A_ &client->c_watcher);
+    ev_io_stop(EV_A_ &client->ts_watcher);
+    client->worker = NULL;
+
+    if (!na_event_worker_offer(worker, client)) {
+        client->worker = worker;
+        return false;
+    }
+
+    na_event_worker_client_detach(worker);
+    atomic_fetch_add_explicit(&worker->donate_cnt, 1, memory_order_relaxed);
+
+    return true;
+}
+
+static bool na_event_worker_offer(na_event_worker_t *worker, na_client_t *client)
+{
+    na_event_worker_t *thief;
+
+    if (!na_event_deque_push(worker->deque, client)) {
+        return false;
+    }
+
+    if (worker->thief >= 0 && !worker->is_thief_kicked) {
+        thief = &worker->env->workers[worker->thief];
+        ev_async_send(thief->loop, &thief->async_watcher);
+        worker->is_thief_kicked = true;
+    }
+
+    return true;
+}
+
+static void na_event_worker_steal(EV_P_ na_event_worker_t *worker)
 {
-    struct ev_loop *loop;
     na_env_t *env;
+    na_event_worker_t *victim;
     na_client_t *client;
-    static int tid_s = 0;
-    int tid;
+    int cnt;
 
-    env  = (na_env_t *)args;
-    pthread_mutex_lock(&env->lock_loop);
-    loop = na_event_loop_create(env->event_model);
-    pthread_mutex_unlock(&env->lock_loop);
+    env = worker->env;
+    cnt = 0;
+
+    for (int i=1;i<env->worker_max && cnt<NA_EVENT_STEAL_BATCH_MAX;++i) {
+        victim = &env->workers[(worker->id + i) % env->worker_max];
+        while (cnt < NA_EVENT_STEAL_BATCH_MAX &&
+               (client = na_event_deque_steal(victim->deque)) != NULL)
+        {
+            na_event_worker_client_start(EV_A_ worker, client);
+            ++cnt;
+        }
+    }
+
+    if (cnt > 0) {
+        atomic_fetch_add_explicit(&worker->steal_cnt, cnt, memory_order_relaxed);
+    }
+}
 
-    pthread_mutex_lock(&env->lock_tid);
-    tid = tid_s++;
-    pthread_mutex_unlock(&env->lock_tid);
+/**
+ * select the least loaded sibling as the thief
+ * when this worker is saturated. returns -1 when no one is.
+ */
+static int na_event_worker_thief_select(na_event_worker_t *worker)
+{
+    na_env_t *env;
+    int load, thief_load, sibling_load, thief;
 
-    while (true) {
-        client = na_event_queue_pop(EventQueue);
+    env   = worker->env;
+    load  = atomic_load_explicit(&worker->load, memory_order_relaxed);
+    thief = -1;
 
-        if (client == NULL) {
-            pthread_mutex_lock(&EventQueue->lock);
-            if (EventQueue->cnt == 0) {
-                pthread_cond_wait(&EventQueue->cond, &EventQueue->lock);
-            }
-            pthread_mutex_unlock(&EventQueue->lock);
+    if (load < NA_EVENT_LOAD_SATURATED) {
+        return -1;
+    }
+
+    thief_load = load - NA_EVENT_LOAD_DIFF_MIN;
+    for (int i=0;i<env->worker_max;++i) {
+        if (i == worker->id) {
             continue;
         }
+        sibling_load = atomic_load_explicit(&env->workers[i].load, memory_order_relaxed);
+        if (sibling_load <= thief_load) {
+            thief      = i;
+            thief_load = sibling_load;
+        }
+    }
 
-        ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-        ev_io_start(EV_A_ &client->c_watcher);
-        pthread_rwlock_wrlock(&env->lock_worker_busy[tid]);
-        env->is_worker_busy[tid] = true;
-        pthread_rwlock_unlock(&env->lock_worker_busy[tid]);
-        ev_loop(EV_A_ 0);
-        pthread_rwlock_wrlock(&env->lock_worker_busy[tid]);
-        env->is_worker_busy[tid] = false;
-        pthread_rwlock_unlock(&env->lock_worker_busy[tid]);
+    return thief;
+}
+
+static void na_event_worker_async_callback(EV_P_ ev_async *w, int revents)
+{
+    na_event_worker_t *worker;
+    na_client_t *client;
+
+    worker = (na_event_worker_t *)w->data;
+
+    while ((client = na_event_queue_pop(worker->queue)) != NULL) {
+        na_event_worker_client_enter(EV_A_ worker, client);
+    }
+
+    if (worker->env->is_work_stealing) {
+        na_event_worker_steal(EV_A_ worker);
+    }
+}
+
+/**
+ * called right before the loop blocks. take back clients nobody stole
+ * and refresh the load of the worker, which is the permille of time
+ * spent outside of polling.
+ */
+static void na_event_worker_prepare_callback(EV_P_ ev_prepare *w, int revents)
+{
+    na_event_worker_t *worker;
+    na_client_t *client;
+    ev_tstamp total;
+
+    worker = (na_event_worker_t *)w->data;
+
+    if (worker->env->is_work_stealing) {
+        while ((client = na_event_deque_pop(worker->deque)) != NULL) {
+            na_event_worker_client_start(EV_A_ worker, client);
+        }
+
+        worker->poll_begin  = ev_time();
+        worker->busy_time  += worker->poll_begin - worker->poll_end;
+        total               = worker->busy_time + worker->idle_time;
+        if (total >= NA_EVENT_LOAD_WINDOW) {
+            atomic_store_explicit(&worker->load, (int)(1000 * worker->busy_time / total), memory_order_relaxed);
+            worker->busy_time = 0.;
+            worker->idle_time = 0.;
+            worker->thief     = na_event_worker_thief_select(worker);
+        }
+        worker->is_thief_kicked = false;
+    }
+
+    // no topology is referenced while polling
+    na_topology_reader_offline(&worker->topology_epoch);
+}
+
+static void na_event_worker_check_callback(EV_P_ ev_check *w, int revents)
+{
+    na_event_worker_t *worker;
+
+    worker = (na_event_worker_t *)w->data;
+
+    na_topology_reader_online(worker->env, &worker->topology_epoch);
+
+    if (worker->env->is_work_stealing) {
+        worker->poll_end   = ev_time();
+        worker->idle_time += worker->poll_end - worker->poll_begin;
+    }
+}
+
+static void na_front_server_prepare_callback(EV_P_ ev_prepare *w, int revents)
+{
+    na_env_t *env;
+
+    env = (na_env_t *)w->data;
+
+    na_topology_reader_offline(&env->acceptor_epoch);
+}
+
+static void na_front_server_check_callback(EV_P_ ev_check *w, int revents)
+{
+    na_env_t *env;
+
+    env = (na_env_t *)w->data;
+
+    na_topology_reader_online(env, &env->acceptor_epoch);
+}
+
+/**
+ * keep the environment on its numa node and cpu set.
+ * the calling thread is bound first so that every thread
+ * and buffer created afterwards inherits the placement.
+ */
+static bool na_event_affinity_setup (na_env_t *env, cpu_set_t *cpuset)
+{
+    cpu_set_t nodeset;
+
+    CPU_ZERO(cpuset);
+
+    if (env->numa_node >= 0) {
+        if (!na_numa_node_bind(env->numa_node)) {
+            NA_ERROR_OUTPUT(env, "failed to prefer memory of numa_node");
+        }
+        if (!na_numa_node_cpuset(env->numa_node, &nodeset)) {
+            NA_ERROR_OUTPUT(env, "failed to read cpus of numa_node");
+            CPU_ZERO(&nodeset);
+        }
+    }
+
+    if (strlen(env->cpu_affinity) > 0) {
+        if (!na_cpuset_parse(env->cpu_affinity, cpuset)) {
+            NA_ERROR_OUTPUT(env, "invalid cpu_affinity");
+            CPU_ZERO(cpuset);
+        } else if (env->numa_node >= 0 && CPU_COUNT(&nodeset) > 0) {
+            CPU_AND(cpuset, cpuset, &nodeset);
+            if (CPU_COUNT(cpuset) == 0) {
+                NA_ERROR_OUTPUT(env, "cpu_affinity has no cpu on numa_node");
+            }
+        }
+    } else if (env->numa_node >= 0) {
+        CPU_OR(cpuset, cpuset, &nodeset);
+    }
+
+    if (CPU_COUNT(cpuset) == 0) {
+        return false;
+    }
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpuset) != 0) {
+        NA_ERROR_OUTPUT(env, "failed to set cpu affinity");
+        return false;
     }
 
+    return true;
+}
+
+static void *na_event_observer(void *args)
+{
+    struct ev_loop *loop;
+    na_event_worker_t *worker;
+    cpu_set_t cpuset;
+
+    worker = (na_event_worker_t *)args;
+    loop   = worker->loop;
+
+    if (worker->cpu >= 0) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(worker->cpu, &cpuset);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+            NA_ERROR_OUTPUT(worker->env, "failed to pin worker to cpu");
+        }
+    }
+
+    // the async watcher keeps this loop alive while there is no client
+    ev_loop(EV_A_ 0);
+
     return NULL;
 }
 
@@ -691,19 +2416,38 @@ void *na_event_loop (void *args)
     na_env_t  *env;
     pthread_t  th_support;
     pthread_t *th_workers;
+    cpu_set_t  cpuset;
+    bool       is_cpu_affinity;
+    ev_prepare fs_prepare_watcher;
+    ev_check   fs_check_watcher;
 
     // for assign connection from connpool directional-ramdomly
     srand(time(NULL));
 
     env = (na_env_t *)args;
 
+    is_cpu_affinity = na_event_affinity_setup(env, &cpuset);
+
+    // io_uring needs libev 4.31 or later built with its io_uring backend
+    if (!na_event_model_is_supported(env->event_model)) {
+        NA_ERROR_OUTPUT(env, "io_uring is not supported by libev, fallback to epoll");
+        env->event_model = NA_EVENT_MODEL_EPOLL;
+    }
+
     if (strlen(env->fssockpath) > 0) {
+        if (env->is_reuseport) {
+            NA_ERROR_OUTPUT(env, "reuseport is ignored for unix domain socket");
+            env->is_reuseport = false;
+        }
         env->fsfd = na_front_server_unixsock_init(env->fssockpath, env->access_mask, env->conn_max);
+    } else if (env->is_reuseport) {
+        // each worker binds its own listener below
+        env->fsfd = -1;
     } else {
-        env->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max);
+        env->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max, false);
     }
 
-    if (env->fsfd < 0) {
+    if (!env->is_reuseport && env->fsfd < 0) {
         NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
     }
 
@@ -717,6 +2461,7 @@ void *na_event_loop (void *args)
     na_target_server_hcsock_setup(env->tsfd);
 
     na_connpool_init(env);
+    na_topology_init(env);
 
     ClientPool = calloc(sizeof(na_client_t), env->client_pool_max);
     memset(ClientPool, 0, sizeof(na_client_t) * env->client_pool_max);
@@ -727,12 +2472,72 @@ void *na_event_loop (void *args)
         pthread_mutex_init(&ClientPool[i].lock_use, NULL);
     }
 
-    if (EventQueue == NULL) {
-        EventQueue = na_event_queue_create(env->conn_max);
+    env->workers = calloc(sizeof(na_event_worker_t), env->worker_max);
+    for (int i=0;i<env->worker_max;++i) {
+        na_event_worker_t *worker = &env->workers[i];
+        worker->id       = i;
+        worker->env      = env;
+        worker->conn_cnt = 0;
+        worker->cpu      = is_cpu_affinity ? na_cpuset_nth(&cpuset, i) : -1;
+        worker->thief    = -1;
+        worker->queue    = na_event_queue_create(env->conn_max);
+        worker->deque    = na_event_deque_create(env->conn_max);
+        atomic_init(&worker->load,       0);
+        atomic_init(&worker->steal_cnt,  0);
+        atomic_init(&worker->donate_cnt, 0);
+        atomic_init(&worker->topology_epoch, 0);
+        na_collapse_init(worker);
+        worker->batch     = calloc(sizeof(na_client_t *), env->batch_key_max);
+        worker->batch_cnt = 0;
+        for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+            atomic_init(&worker->batch_hist[j], 0);
+        }
+        atomic_init(&worker->noreply_cnt,       0);
+        atomic_init(&worker->noreply_error_cnt, 0);
+        for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+            atomic_init(&worker->fanout_hist[j], 0);
+        }
+        atomic_init(&worker->fanout_dedup_cnt, 0);
+        atomic_init(&worker->hedge_cnt,        0);
+        atomic_init(&worker->hedge_win_cnt,    0);
+        worker->batch_timer.data = worker;
+        ev_timer_init(&worker->batch_timer, na_event_batch_timer_callback, 0., 0.);
+        pthread_mutex_lock(&env->lock_loop);
+        worker->loop     = na_event_loop_create(env->event_model);
+        pthread_mutex_unlock(&env->lock_loop);
+        worker->async_watcher.data = worker;
+        ev_async_init(&worker->async_watcher, na_event_worker_async_callback);
+        ev_async_start(worker->loop, &worker->async_watcher);
+        // the check watcher must run before any other callback of the iteration
+        worker->poll_begin           = ev_time();
+        worker->poll_end             = worker->poll_begin;
+        worker->prepare_watcher.data = worker;
+        worker->check_watcher.data   = worker;
+        ev_prepare_init(&worker->prepare_watcher, na_event_worker_prepare_callback);
+        ev_check_init(&worker->check_watcher, na_event_worker_check_callback);
+        ev_set_priority(&worker->check_watcher, EV_MAXPRI);
+        ev_prepare_start(worker->loop, &worker->prepare_watcher);
+        ev_check_start(worker->loop, &worker->check_watcher);
+        worker->fsfd = -1;
+        if (env->is_reuseport) {
+            worker->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max, true);
+            if (worker->fsfd < 0) {
+                NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+            }
+            if (i == 0 && env->is_reuseport_cbpf &&
+                !na_front_server_reuseport_cbpf_attach(worker->fsfd, env->worker_max))
+            {
+                NA_ERROR_OUTPUT(env, "failed to attach reuseport cbpf program");
+            }
+            worker->fs_watcher.data = worker;
+            ev_io_init(&worker->fs_watcher, na_front_server_reuseport_callback, worker->fsfd, EV_READ);
+            ev_io_start(worker->loop, &worker->fs_watcher);
+        }
     }
+
     th_workers = calloc(sizeof(pthread_t), env->worker_max);
     for (int i=0;i<env->worker_max;++i) {
-        pthread_create(&th_workers[i], NULL, na_event_observer, env);
+        pthread_create(&th_workers[i], NULL, na_event_observer, &env->workers[i]);
     }
 
     if (strlen(env->stsockpath) > 0) {
@@ -742,21 +2547,42 @@ void *na_event_loop (void *args)
     }
     pthread_create(&th_support, NULL, na_support_loop, env);
 
-    pthread_mutex_lock(&env->lock_loop);
-    loop = na_event_loop_create(env->event_model);
-    pthread_mutex_unlock(&env->lock_loop);
-    env->fs_watcher.data = env;
-    ev_io_init(&env->fs_watcher, na_front_server_callback, env->fsfd, EV_READ);
-    ev_io_start(EV_A_ &env->fs_watcher);
-    ev_loop(EV_A_ 0);
+    if (env->is_reuseport) {
+        // there is no central acceptor, workers accept by themselves
+        for (int i=0;i<env->worker_max;++i) {
+            pthread_join(th_workers[i], NULL);
+        }
+    } else {
+        pthread_mutex_lock(&env->lock_loop);
+        loop = na_event_loop_create(env->event_model);
+        pthread_mutex_unlock(&env->lock_loop);
+        env->fs_watcher.data = env;
+        ev_io_init(&env->fs_watcher, na_front_server_callback, env->fsfd, EV_READ);
+        ev_io_start(EV_A_ &env->fs_watcher);
+        fs_prepare_watcher.data = env;
+        fs_check_watcher.data   = env;
+        ev_prepare_init(&fs_prepare_watcher, na_front_server_prepare_callback);
+        ev_check_init(&fs_check_watcher, na_front_server_check_callback);
+        ev_set_priority(&fs_check_watcher, EV_MAXPRI);
+        ev_prepare_start(EV_A_ &fs_prepare_watcher);
+        ev_check_start(EV_A_ &fs_check_watcher);
+        ev_loop(EV_A_ 0);
+    }
 
     for (int i=0;i<env->client_pool_max;++i) {
         NA_FREE(ClientPool[i].crbuf);
         NA_FREE(ClientPool[i].srbuf);
+        NA_FREE(ClientPool[i].twbuf);
         pthread_mutex_destroy(&ClientPool[i].lock_use);
     }
     NA_FREE(ClientPool);
-    na_event_queue_destroy(EventQueue);
+    for (int i=0;i<env->worker_max;++i) {
+        na_event_queue_destroy(env->workers[i].queue);
+        na_event_deque_destroy(env->workers[i].deque);
+        na_collapse_destroy(&env->workers[i]);
+        NA_FREE(env->workers[i].batch);
+    }
+    na_topology_destroy(env);
 
     return NULL;
 }
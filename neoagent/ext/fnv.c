@@ -183,6 +183,18 @@ void fnv_tbl_print(fnv_tbl_t *tbl, size_t c) {
     }
 }
 
+/**
+ * FNV-1a hash of k with ksiz bytes
+ */
+uint_t fnv_1a_hash(const char *k, size_t ksiz) {
+    uint_t h = FNV_OFFSET_BASIS;
+    for (uchar_t *p=(uchar_t *)k;p<(uchar_t *)k+ksiz;++p) {
+        h ^= *p;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
 /* following is private function */ 
 
 /**
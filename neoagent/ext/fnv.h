@@ -108,5 +108,6 @@ int fnv_put(fnv_tbl_t *tbl, const char *k, const void *v, size_t ksiz, size_t vs
 int fnv_out(fnv_tbl_t *tbl, const char *k, size_t ksiz);
 void fnv_tbl_destroy(fnv_tbl_t *tbl);
 void fnv_tbl_print(fnv_tbl_t *tbl, size_t c);
+uint_t fnv_1a_hash(const char *k, size_t ksiz);
 
 #endif // FNV_H
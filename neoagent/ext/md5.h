@@ -0,0 +1,31 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/* written by C99 style */
+
+#ifndef MD5_H
+#define MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MD5_DIGEST_SIZE 16
+
+typedef struct md5_ctx_s {
+    uint32_t state[4];
+    uint64_t size;      // bytes processed
+    unsigned char buf[64];
+} md5_ctx_t;
+
+void md5_init(md5_ctx_t *ctx);
+void md5_update(md5_ctx_t *ctx, const void *data, size_t size);
+void md5_final(md5_ctx_t *ctx, unsigned char digest[MD5_DIGEST_SIZE]);
+void md5_digest(const void *data, size_t size, unsigned char digest[MD5_DIGEST_SIZE]);
+
+#endif // MD5_H
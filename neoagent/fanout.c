@@ -0,0 +1,379 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * a multi-key get whose keys belong to several target servers is split.
+ * a get of the distinct keys of each server(leg) is sent on its own
+ * connection and the VALUE blocks of the responses are put back
+ * in the order of the keys of the request.
+ */
+
+static const int NA_FANOUT_BUFSIZE_MIN = 1024;
+
+// private functions
+static bool na_fanout_append (char **buf, int *bufsize, int *cap, const char *data, int size);
+static bool na_fanout_key_next (const char **p, const char *end, const char **key, int *keylen);
+static int na_fanout_leg_values (na_fanout_t *fanout, int l, const char *buf);
+
+/**
+ * cap is the usable size of buf, which is allocated with a byte for NUL.
+ */
+static bool na_fanout_append (char **buf, int *bufsize, int *cap, const char *data, int size)
+{
+    int es;
+    char *b;
+
+    if (*bufsize + size > *cap) {
+        es = *cap > 0 ? *cap : NA_FANOUT_BUFSIZE_MIN;
+        while (es < *bufsize + size) {
+            es *= 2;
+        }
+        b = (char *)realloc(*buf, es + 1);
+        if (b == NULL) {
+            return false;
+        }
+        *buf = b;
+        *cap = es;
+    }
+
+    memcpy(*buf + *bufsize, data, size);
+    *bufsize += size;
+
+    return true;
+}
+
+static bool na_fanout_key_next (const char **p, const char *end, const char **key, int *keylen)
+{
+    while (*p < end && **p == ' ') {
+        ++*p;
+    }
+    if (*p == end) {
+        return false;
+    }
+
+    *key = *p;
+    while (*p < end && **p != ' ') {
+        ++*p;
+    }
+    *keylen = *p - *key;
+
+    return true;
+}
+
+/**
+ * match the VALUE blocks of the leg with its keys, which are answered in order.
+ * returns 1 when the leg responds other than VALUE blocks, 0 on success and -1 on error.
+ */
+static int na_fanout_leg_values (na_fanout_t *fanout, int l, const char *buf)
+{
+    int i, keylen, size;
+    long bytes;
+    const char *p, *end, *nl, *key, *sp;
+    char *ep;
+    na_fanout_leg_t *leg;
+    na_fanout_key_t *k;
+
+    leg = &fanout->legs[l];
+    p   = leg->rbuf;
+    end = leg->rbuf + leg->rbufsize;
+    i   = 0;
+    for (;;) {
+        nl = na_scan_byte(p, end - p, '\n');
+        if (nl == NULL) {
+            return -1;
+        }
+        if (nl - p == 4 && memcmp(p, "END\r", 4) == 0) {
+            return 0;
+        }
+        if (nl - p < 6 || memcmp(p, "VALUE ", 6) != 0) {
+            return 1;
+        }
+
+        // VALUE <key> <flags> <bytes> [<cas unique>]
+        key = p + 6;
+        sp  = na_scan_byte(key, nl - key, ' ');
+        if (sp == NULL) {
+            return -1;
+        }
+        keylen = sp - key;
+        sp     = na_scan_byte(sp + 1, nl - sp - 1, ' ');
+        if (sp == NULL) {
+            return -1;
+        }
+        bytes = strtol(sp + 1, &ep, 10);
+        if (ep == sp + 1 || bytes < 0 || bytes > end - nl) {
+            return -1;
+        }
+        size = nl - p + 1 + bytes + 2;
+        if (size > end - p) {
+            return -1;
+        }
+
+        // keys without VALUE block are misses
+        for (;i<fanout->key_cnt;++i) {
+            k = &fanout->keys[i];
+            if (k->leg == l && k->first == i &&
+                k->keylen == keylen && memcmp(buf + k->offset, key, keylen) == 0)
+            {
+                break;
+            }
+        }
+        if (i == fanout->key_cnt) {
+            return -1;
+        }
+        fanout->keys[i].value     = p - leg->rbuf;
+        fanout->keys[i].valuesize = size;
+        ++i;
+        p += size;
+    }
+}
+
+/**
+ * buf is a get of the keys on more than one target server.
+ */
+bool na_fanout_is_spread (na_env_t *env, const char *buf, int bufsize)
+{
+    int node, keylen;
+    const char *p, *end, *key;
+
+    if (bufsize < 5 || memcmp(buf, "get", 3) != 0 ||
+        buf[bufsize - 2] != '\r' || buf[bufsize - 1] != '\n')
+    {
+        return false;
+    }
+
+    p = na_scan_byte(buf, bufsize - 2, ' ');
+    if (p == NULL) {
+        return false;
+    }
+    end  = buf + bufsize - 2;
+    node = -1;
+    while (na_fanout_key_next(&p, end, &key, &keylen)) {
+        if (node == -1) {
+            node = na_ketama_node(env, key, keylen);
+        } else if (na_ketama_node(env, key, keylen) != node) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * build a get of each target server from the get in buf.
+ * the same key is requested once.
+ */
+na_fanout_t *na_fanout_create (na_env_t *env, const char *buf, int bufsize)
+{
+    int cnt, cmdlen, keylen, node, l;
+    int legs[NA_TARGET_SERVER_MAX];
+    const char *p, *end, *key;
+    na_fanout_t *fanout;
+    na_fanout_key_t *k;
+    na_fanout_leg_t *leg;
+
+    end    = buf + bufsize - 2;
+    p      = na_scan_byte(buf, end - buf, ' ');
+    cmdlen = p - buf;
+
+    cnt = 0;
+    while (na_fanout_key_next(&p, end, &key, &keylen)) {
+        ++cnt;
+    }
+
+    fanout = (na_fanout_t *)calloc(1, sizeof(na_fanout_t));
+    if (fanout == NULL) {
+        return NULL;
+    }
+    fanout->keys = (na_fanout_key_t *)calloc(sizeof(na_fanout_key_t), cnt);
+    fanout->legs = (na_fanout_leg_t *)calloc(sizeof(na_fanout_leg_t), env->target_server_cnt);
+    if (fanout->keys == NULL || fanout->legs == NULL) {
+        na_fanout_destroy(fanout);
+        return NULL;
+    }
+
+    for (int i=0;i<env->target_server_cnt;++i) {
+        legs[i] = -1;
+    }
+
+    p = buf + cmdlen;
+    while (na_fanout_key_next(&p, end, &key, &keylen)) {
+        k         = &fanout->keys[fanout->key_cnt];
+        k->offset = key - buf;
+        k->keylen = keylen;
+        k->hash   = fnv_1a_hash(key, keylen);
+        k->first  = fanout->key_cnt;
+        k->value  = -1;
+        for (int i=0;i<fanout->key_cnt;++i) {
+            if (fanout->keys[i].hash == k->hash && fanout->keys[i].keylen == keylen &&
+                memcmp(buf + fanout->keys[i].offset, key, keylen) == 0)
+            {
+                k->first = fanout->keys[i].first;
+                break;
+            }
+        }
+        ++fanout->key_cnt;
+
+        if (k->first != fanout->key_cnt - 1) {
+            k->leg = fanout->keys[k->first].leg;
+            ++fanout->dup_cnt;
+            continue;
+        }
+
+        node = na_ketama_node(env, key, keylen);
+        l    = legs[node];
+        if (l == -1) {
+            l             = fanout->leg_cnt++;
+            legs[node]    = l;
+            leg           = &fanout->legs[l];
+            leg->node     = node;
+            leg->fd       = -1;
+            leg->cur_pool = -1;
+            na_memproto_res_parser_init(&leg->res_parser);
+            if (!na_fanout_append(&leg->wbuf, &leg->wbufsize, &leg->wbufcap, buf, cmdlen)) {
+                na_fanout_destroy(fanout);
+                return NULL;
+            }
+        }
+        leg    = &fanout->legs[l];
+        k->leg = l;
+        if (!na_fanout_append(&leg->wbuf, &leg->wbufsize, &leg->wbufcap, " ", 1) ||
+            !na_fanout_append(&leg->wbuf, &leg->wbufsize, &leg->wbufcap, key, keylen))
+        {
+            na_fanout_destroy(fanout);
+            return NULL;
+        }
+    }
+
+    for (int i=0;i<fanout->leg_cnt;++i) {
+        leg = &fanout->legs[i];
+        if (!na_fanout_append(&leg->wbuf, &leg->wbufsize, &leg->wbufcap, "\r\n", 2)) {
+            na_fanout_destroy(fanout);
+            return NULL;
+        }
+    }
+
+    return fanout;
+}
+
+void na_fanout_destroy (na_fanout_t *fanout)
+{
+    if (fanout->legs != NULL) {
+        for (int i=0;i<fanout->leg_cnt;++i) {
+            NA_FREE(fanout->legs[i].wbuf);
+            NA_FREE(fanout->legs[i].rbuf);
+        }
+    }
+    NA_FREE(fanout->keys);
+    NA_FREE(fanout->legs);
+    NA_FREE(fanout);
+}
+
+/**
+ * a leg which sends buf as it is(e.g. a hedged get).
+ */
+na_fanout_leg_t *na_fanout_leg_create (const char *buf, int bufsize)
+{
+    na_fanout_leg_t *leg;
+
+    leg = (na_fanout_leg_t *)calloc(1, sizeof(na_fanout_leg_t));
+    if (leg == NULL) {
+        return NULL;
+    }
+    leg->node     = -1;
+    leg->fd       = -1;
+    leg->cur_pool = -1;
+    na_memproto_res_parser_init(&leg->res_parser);
+
+    if (!na_fanout_append(&leg->wbuf, &leg->wbufsize, &leg->wbufcap, buf, bufsize)) {
+        NA_FREE(leg);
+        return NULL;
+    }
+
+    return leg;
+}
+
+void na_fanout_leg_destroy (na_fanout_leg_t *leg)
+{
+    NA_FREE(leg->wbuf);
+    NA_FREE(leg->rbuf);
+    NA_FREE(leg);
+}
+
+/**
+ * room for reading the response of the leg.
+ */
+bool na_fanout_rbuf_reserve (na_fanout_leg_t *leg)
+{
+    int es;
+    char *b;
+
+    if (leg->rbufsize < leg->rbufcap) {
+        return true;
+    }
+
+    es = leg->rbufcap > 0 ? leg->rbufcap * 2 : NA_FANOUT_BUFSIZE_MIN;
+    b  = (char *)realloc(leg->rbuf, es + 1);
+    if (b == NULL) {
+        return false;
+    }
+    leg->rbuf    = b;
+    leg->rbufcap = es;
+
+    return true;
+}
+
+/**
+ * put the VALUE blocks of the legs in the order of the keys in buf into res.
+ * when a leg responds other than VALUE blocks(e.g. SERVER_ERROR), it is the response.
+ */
+bool na_fanout_response (na_fanout_t *fanout, const char *buf, char **res, int *ressize, int *rescap)
+{
+    int ret;
+    na_fanout_key_t *k;
+    na_fanout_leg_t *leg;
+
+    *ressize = 0;
+
+    for (int l=0;l<fanout->leg_cnt;++l) {
+        ret = na_fanout_leg_values(fanout, l, buf);
+        if (ret < 0) {
+            return false;
+        } else if (ret > 0) {
+            leg = &fanout->legs[l];
+            if (!na_fanout_append(res, ressize, rescap, leg->rbuf, leg->rbufsize)) {
+                return false;
+            }
+            (*res)[*ressize] = '\0';
+            return true;
+        }
+    }
+
+    for (int i=0;i<fanout->key_cnt;++i) {
+        k = &fanout->keys[fanout->keys[i].first];
+        if (k->value == -1) {
+            continue;
+        }
+        leg = &fanout->legs[k->leg];
+        if (!na_fanout_append(res, ressize, rescap, leg->rbuf + k->value, k->valuesize)) {
+            return false;
+        }
+    }
+
+    if (!na_fanout_append(res, ressize, rescap, "END\r\n", 5)) {
+        return false;
+    }
+    (*res)[*ressize] = '\0';
+
+    return true;
+}
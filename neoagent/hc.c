@@ -114,33 +114,27 @@ void na_hc_callback (EV_P_ ev_timer *w, int revents)
 
     // health check
     if (env->is_refused_active && na_hc_test_request(env->tsfd, env->try_max)) {
-        pthread_rwlock_wrlock(&env->lock_refused);
-        env->is_refused_accept = true;
+        na_topology_publish(env, true); // refuse accept while switching
         env->is_refused_active = false;
         pthread_mutex_lock(&env->lock_connpool);
         na_connpool_switch(env);
         pthread_mutex_unlock(&env->lock_connpool);
-        pthread_mutex_lock(&env->lock_current_conn);
-        env->current_conn = 0;
-        pthread_mutex_unlock(&env->lock_current_conn);
-        env->is_refused_accept = false;
-        pthread_rwlock_unlock(&env->lock_refused);
+        atomic_store(&env->current_conn, 0);
+        na_topology_publish(env, false);
         NA_ERROR_OUTPUT(env, "switch target server");
     } else if (!env->is_refused_active && !na_hc_test_request(env->tsfd, env->try_max)) {
-        pthread_rwlock_wrlock(&env->lock_refused);
-        env->is_refused_accept = true;
+        na_topology_publish(env, true); // refuse accept while switching
         env->is_refused_active = true;
         pthread_mutex_lock(&env->lock_connpool);
         na_connpool_switch(env);
         pthread_mutex_unlock(&env->lock_connpool);
-        pthread_mutex_lock(&env->lock_current_conn);
-        env->current_conn = 0;
-        pthread_mutex_unlock(&env->lock_current_conn);
-        env->is_refused_accept = false;
-        pthread_rwlock_unlock(&env->lock_refused);
+        atomic_store(&env->current_conn, 0);
+        na_topology_publish(env, false);
         NA_ERROR_OUTPUT(env, "switch backup server");
         close(env->tsfd);
     }
 
+    na_topology_reclaim(env);
+
     na_hc_event_set(EV_A_ w, revents);
 }
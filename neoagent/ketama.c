@@ -0,0 +1,113 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defines.h"
+#include "ext/md5.h"
+
+/**
+ * consistent hashing of keys over target_servers.
+ * points of the ring are placed as libketama does, 160 points per server
+ * scaled by its weight and 4 points per MD5 digest of "host:port-n".
+ * a key is hashed with FNV-1a and served by the first point at or after it.
+ */
+
+static const int NA_KETAMA_POINTS_PER_SERVER = 160;
+static const int NA_KETAMA_POINTS_PER_HASH   = 4;
+
+// private functions
+static int na_ketama_point_cmp (const void *a, const void *b);
+
+static int na_ketama_point_cmp (const void *a, const void *b)
+{
+    const na_ketama_point_t *pa = a;
+    const na_ketama_point_t *pb = b;
+
+    if (pa->value == pb->value) {
+        return 0;
+    }
+    return pa->value < pb->value ? -1 : 1;
+}
+
+bool na_ketama_build (na_env_t *env)
+{
+    int weight_total, cnt, ks, len;
+    char buf[NA_HOSTNAME_MAX + 32];
+    unsigned char digest[MD5_DIGEST_SIZE];
+    na_server_t *server;
+    na_ketama_point_t *points;
+
+    weight_total = 0;
+    for (int i=0;i<env->target_server_cnt;++i) {
+        weight_total += env->target_servers[i].weight;
+    }
+
+    points = (na_ketama_point_t *)calloc(sizeof(na_ketama_point_t),
+                                         NA_KETAMA_POINTS_PER_SERVER * env->target_server_cnt);
+    if (points == NULL) {
+        return false;
+    }
+
+    cnt = 0;
+    for (int i=0;i<env->target_server_cnt;++i) {
+        server = &env->target_servers[i];
+        // floor(weight / weight_total * 40 * target_server_cnt) digests
+        ks     = (int)((int64_t)server->weight * NA_KETAMA_POINTS_PER_SERVER / NA_KETAMA_POINTS_PER_HASH *
+                       env->target_server_cnt / weight_total);
+        for (int k=0;k<ks;++k) {
+            len = snprintf(buf, sizeof(buf), "%s:%u-%d", server->host.ipaddr, server->host.port, k);
+            md5_digest(buf, len, digest);
+            for (int h=0;h<NA_KETAMA_POINTS_PER_HASH;++h) {
+                points[cnt].value = ((uint32_t)digest[3 + h * 4] << 24) |
+                                    ((uint32_t)digest[2 + h * 4] << 16) |
+                                    ((uint32_t)digest[1 + h * 4] <<  8) |
+                                    ((uint32_t)digest[h * 4]);
+                points[cnt].node  = i;
+                ++cnt;
+            }
+        }
+    }
+
+    qsort(points, cnt, sizeof(na_ketama_point_t), na_ketama_point_cmp);
+
+    NA_FREE(env->ketama);
+    env->ketama     = points;
+    env->ketama_cnt = cnt;
+
+    return true;
+}
+
+/**
+ * index of target_servers which serves the key.
+ */
+int na_ketama_node (na_env_t *env, const char *key, int keylen)
+{
+    uint32_t hash;
+    int lo, hi, mid;
+
+    if (env->ketama_cnt == 0) {
+        return 0;
+    }
+
+    hash = fnv_1a_hash(key, keylen);
+    lo   = 0;
+    hi   = env->ketama_cnt;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (env->ketama[mid].value < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // wraps around the ring
+    return env->ketama[lo == env->ketama_cnt ? 0 : lo].node;
+}
@@ -7,29 +7,320 @@
  */
 
 #include <string.h>
+#include <stdint.h>
 
 #include "defines.h"
 
-typedef enum na_memproto_bm_skip_t {
-    NA_MEMPROTO_BM_SKIP_CRLF,
-    NA_MEMPROTO_BM_SKIP_ENDCRLF,
-    NA_MEMPROTO_BM_SKIP_MAX // Always add new codes to the end before this one
-} na_memproto_bm_skip_t;
+static const int NA_MEMPROTO_LINE_MAX = 1024;
+static const int NA_MEMPROTO_KEY_MAX  = 250;
 
-static int na_bm_skip[NA_MEMPROTO_BM_SKIP_MAX][NA_BM_SKIP_SIZE] = {
-    [NA_MEMPROTO_BM_SKIP_CRLF]    = {},
-    [NA_MEMPROTO_BM_SKIP_ENDCRLF] = {},
+static const unsigned char NA_MEMPROTO_BIN_MAGIC_REQUEST  = 0x80;
+static const unsigned char NA_MEMPROTO_BIN_MAGIC_RESPONSE = 0x81;
+static const unsigned char NA_MEMPROTO_BIN_OPCODE_QUIT    = 0x07;
+static const unsigned char NA_MEMPROTO_BIN_OPCODE_NOOP    = 0x0a;
+static const unsigned char NA_MEMPROTO_BIN_OPCODE_QUITQ   = 0x17;
+static const uint32_t NA_MEMPROTO_BIN_BODY_MAX            = INT32_MAX - NA_MEMPROTO_BIN_HEADER_SIZE;
+
+// the private noop with the opaque "neoa"
+static const char NA_MEMPROTO_BIN_BARRIER[NA_MEMPROTO_BIN_HEADER_SIZE] = {
+    0x80, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x6e, 0x65, 0x6f, 0x61,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
+static const char *NA_MEMPROTO_META_BARRIER = "mn\r\n";
+
+// private functions
+static bool na_memproto_parse_uint (const char **p, const char *end, uint64_t max, uint64_t *v);
+static bool na_memproto_res_line_parse (na_memproto_res_parser_t *parser, const char *line, int len);
+static bool na_memproto_is_noreply (const char *line, int len);
+static uint32_t na_memproto_bin_be32 (const unsigned char *p);
+static bool na_memproto_bin_is_quiet (int opcode);
+static void na_memproto_bin_packet_end (na_memproto_res_parser_t *parser);
+static bool na_memproto_meta_value_parse (na_memproto_res_parser_t *parser, const char *line, const char *end, bool is_value_end);
+static bool na_memproto_meta_is_quiet (const char *line, const char *end);
+static long na_memproto_meta_set_size (const char *buf, const char *nl);
+
+static bool na_memproto_parse_uint (const char **p, const char *end, uint64_t max, uint64_t *v)
+{
+    const char *s;
+
+    s  = *p;
+    *v = 0;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (*v > (max - (**p - '0')) / 10) {
+            return false;
+        }
+        *v = *v * 10 + (**p - '0');
+        ++*p;
+    }
+
+    return *p > s;
+}
+
+/**
+ * a line of get responses including the trailing CRLF.
+ *
+ *   VALUE <key> <flags> <bytes> [<cas unique>]\r\n
+ *   END\r\n
+ *
+ * an error line terminates the response as well as END.
+ * with the barrier of meta commands, lines are passed through
+ * until MN and only data blocks are skipped.
+ */
+static bool na_memproto_res_line_parse (na_memproto_res_parser_t *parser, const char *line, int len)
+{
+    const char *p, *end, *key;
+    uint64_t v;
+
+    if (len < 2 || line[len - 2] != '\r') {
+        return false;
+    }
+    end = line + len - 2;
+
+    if (parser->is_meta) {
+        if (end - line >= 3 && memcmp(line, "VA ", 3) == 0) {
+            return na_memproto_meta_value_parse(parser, line, end, true);
+        }
+        parser->end_cnt++;
+        return true;
+    } else if (parser->is_barrier) {
+        if (end - line == 2 && memcmp(line, "MN", 2) == 0) {
+            parser->end_cnt++;
+            return true;
+        }
+        if (end - line >= 3 && memcmp(line, "VA ", 3) == 0) {
+            return na_memproto_meta_value_parse(parser, line, end, false);
+        }
+        if (end - line < 6 || memcmp(line, "VALUE ", 6) != 0) {
+            return true;
+        }
+    } else if (parser->kind_cnt > 0) {
+        if (parser->end_cnt >= parser->kind_cnt) {
+            return false; // no more response is expected
+        }
+        switch (parser->kinds[parser->end_cnt]) {
+        case NA_MEMPROTO_RES_KIND_LINE:
+            parser->end_cnt++;
+            return true;
+        case NA_MEMPROTO_RES_KIND_META:
+            if (end - line >= 3 && memcmp(line, "VA ", 3) == 0) {
+                return na_memproto_meta_value_parse(parser, line, end, true);
+            }
+            parser->end_cnt++;
+            return true;
+        default:
+            break;
+        }
+    }
+
+    if (end - line == 3 && memcmp(line, "END", 3) == 0) {
+        parser->end_cnt++;
+        return true;
+    }
+
+    if ((end - line == 5 && memcmp(line, "ERROR", 5) == 0) ||
+        (end - line >= 13 && memcmp(line, "CLIENT_ERROR ", 13) == 0) ||
+        (end - line >= 13 && memcmp(line, "SERVER_ERROR ", 13) == 0))
+    {
+        parser->end_cnt++;
+        return true;
+    }
+
+    if (end - line < 6 || memcmp(line, "VALUE ", 6) != 0) {
+        return false;
+    }
+
+    p   = line + 6;
+    key = p;
+    while (p < end && *p > ' ' && *p != 0x7f) {
+        ++p;
+    }
+    if (p == key || p - key > NA_MEMPROTO_KEY_MAX || p == end || *p++ != ' ') {
+        return false;
+    }
+
+    // flags
+    if (!na_memproto_parse_uint(&p, end, UINT32_MAX, &v) || p == end || *p++ != ' ') {
+        return false;
+    }
+
+    // bytes
+    if (!na_memproto_parse_uint(&p, end, INT32_MAX, &v)) {
+        return false;
+    }
+    parser->remain = v;
+
+    // cas unique
+    if (p < end) {
+        if (*p++ != ' ' || !na_memproto_parse_uint(&p, end, UINT64_MAX, &v) || p != end) {
+            return false;
+        }
+    }
+
+    parser->value_cnt++;
+    parser->state = parser->remain > 0 ? NA_MEMPROTO_PARSE_STATE_DATA : NA_MEMPROTO_PARSE_STATE_DATA_CR;
+
+    return true;
+}
+
+/**
+ * a value of meta commands. the response ends with the data block
+ * when is_value_end is true.
+ *
+ *   VA <size> <flags>*\r\n
+ */
+static bool na_memproto_meta_value_parse (na_memproto_res_parser_t *parser, const char *line, const char *end, bool is_value_end)
+{
+    const char *p;
+    uint64_t v;
+
+    p = line + 3;
+    if (!na_memproto_parse_uint(&p, end, INT32_MAX, &v) || (p < end && *p != ' ')) {
+        return false;
+    }
+
+    parser->remain       = v;
+    parser->is_value_end = is_value_end;
+    parser->value_cnt++;
+    parser->state = parser->remain > 0 ? NA_MEMPROTO_PARSE_STATE_DATA : NA_MEMPROTO_PARSE_STATE_DATA_CR;
+
+    return true;
+}
+
+/**
+ * a meta command with the q flag, which suppresses some of its responses.
+ * the command and the key are not flags.
+ */
+static bool na_memproto_meta_is_quiet (const char *line, const char *end)
+{
+    const char *p, *tok;
+    int n;
+
+    p = line;
+    n = 0;
+    while (p < end) {
+        while (p < end && *p == ' ') {
+            ++p;
+        }
+        tok = p;
+        while (p < end && *p != ' ') {
+            ++p;
+        }
+        if (n++ >= 2 && p - tok == 1 && *tok == 'q') {
+            return true;
+        }
+    }
+
+    return false;
+}
 
-void na_memproto_bm_skip_init (void)
+/**
+ * size of ms including its data block.
+ *
+ *   ms <key> <datalen> <flags>*\r\n<data>\r\n
+ */
+static long na_memproto_meta_set_size (const char *buf, const char *nl)
 {
-    na_bm_create_table("\r\n",    na_bm_skip[NA_MEMPROTO_BM_SKIP_CRLF],    NA_BM_SKIP_SIZE);
-    na_bm_create_table("END\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_ENDCRLF], NA_BM_SKIP_SIZE);
+    const char *p, *end, *key;
+    uint64_t bytes;
+
+    p   = buf + 3;
+    end = nl - 1;
+    key = p;
+    while (p < end && *p > ' ' && *p != 0x7f) {
+        ++p;
+    }
+    if (p == key || p - key > NA_MEMPROTO_KEY_MAX || p == end || *p++ != ' ') {
+        return -1;
+    }
+
+    if (!na_memproto_parse_uint(&p, end, INT32_MAX, &bytes) || (p < end && *p != ' ')) {
+        return -1;
+    }
+
+    return (nl - buf + 1) + (long)bytes + 2;
+}
+
+/**
+ * the request line ends with noreply. len includes the trailing CRLF.
+ */
+static bool na_memproto_is_noreply (const char *line, int len)
+{
+    return len >= 10 && memcmp(line + len - 10, " noreply\r\n", 10) == 0;
+}
+
+/**
+ * size of a storage request including its data block.
+ *
+ *   <command> <key> <flags> <exptime> <bytes> [noreply]\r\n<data>\r\n
+ *
+ * returns 0 while the header line is incomplete and -1 when it is malformed.
+ */
+long na_memproto_storage_request_size (const char *buf, int bufsize)
+{
+    const char *p, *end, *nl, *key;
+    uint64_t v, bytes;
+
+    nl = na_scan_byte(buf, bufsize, '\n');
+    if (nl == NULL) {
+        return bufsize > NA_MEMPROTO_LINE_MAX ? -1 : 0;
+    }
+    if (nl == buf || nl[-1] != '\r') {
+        return -1;
+    }
+    end = nl - 1;
+
+    p = na_scan_byte(buf, end - buf, ' ');
+    if (p == NULL) {
+        return -1;
+    }
+    ++p;
+
+    key = p;
+    while (p < end && *p > ' ' && *p != 0x7f) {
+        ++p;
+    }
+    if (p == key || p - key > NA_MEMPROTO_KEY_MAX || p == end || *p++ != ' ') {
+        return -1;
+    }
+
+    // flags
+    if (!na_memproto_parse_uint(&p, end, UINT32_MAX, &v) || p == end || *p++ != ' ') {
+        return -1;
+    }
+
+    // exptime, negative means immediately expired
+    if (p < end && *p == '-') {
+        ++p;
+    }
+    if (!na_memproto_parse_uint(&p, end, INT32_MAX, &v) || p == end || *p++ != ' ') {
+        return -1;
+    }
+
+    // bytes
+    if (!na_memproto_parse_uint(&p, end, INT32_MAX, &bytes)) {
+        return -1;
+    }
+
+    if (p < end) {
+        if (end - p != 8 || memcmp(p, " noreply", 8) != 0) {
+            return -1;
+        }
+    }
+
+    return (nl - buf + 1) + (long)bytes + 2;
 }
 
 na_memproto_cmd_t na_memproto_detect_command (char *buf)
 {
-    if (strncmp(buf, "get", 3) == 0) {
+    if ((unsigned char)buf[0] == NA_MEMPROTO_BIN_MAGIC_REQUEST) {
+        if ((unsigned char)buf[1] == NA_MEMPROTO_BIN_OPCODE_QUIT ||
+            (unsigned char)buf[1] == NA_MEMPROTO_BIN_OPCODE_QUITQ)
+        {
+            return NA_MEMPROTO_CMD_QUIT;
+        }
+        return NA_MEMPROTO_CMD_BINARY;
+    } else if (strncmp(buf, "get", 3) == 0) {
         return NA_MEMPROTO_CMD_GET;
     } else if (strncmp(buf, "set", 3) == 0) {
         return NA_MEMPROTO_CMD_SET;
@@ -43,81 +334,556 @@ na_memproto_cmd_t na_memproto_detect_command (char *buf)
         return NA_MEMPROTO_CMD_DELETE;
     } else if (strncmp(buf, "quit", 4) == 0) {
         return NA_MEMPROTO_CMD_QUIT;
+    } else if (buf[0] == 'm' && buf[1] != '\0' && strchr("gsdanme", buf[1]) != NULL &&
+               (buf[2] == ' ' || buf[2] == '\r'))
+    {
+        return NA_MEMPROTO_CMD_META;
     }
     return NA_MEMPROTO_CMD_UNKNOWN;
 }
 
 int na_memproto_count_request_get (char *buf, int bufsize)
 {
-    return na_bm_search(buf, "\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_CRLF], bufsize, 2);
+    return na_scan_count_crlf(buf, bufsize);
 }
 
-int na_memproto_count_response_get(char *buf, int bufsize)
+void na_memproto_res_parser_init (na_memproto_res_parser_t *parser)
 {
-    //return na_bm_search(buf, "END\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_ENDCRLF], bufsize, 5);
-    //VALUE key flag len
-    char *p;
-    char *tk, *sp;
-    int i;
-    char sizbuf[10];
-    int c;
-    int count = 0;
-    int j;
+    parser->state        = NA_MEMPROTO_PARSE_STATE_LINE;
+    parser->offset       = 0;
+    parser->line         = 0;
+    parser->remain       = 0;
+    parser->value_cnt    = 0;
+    parser->end_cnt      = 0;
+    parser->kind_cnt     = 0;
+    parser->opcode       = 0;
+    parser->is_barrier   = false;
+    parser->is_value_end = false;
+    parser->is_meta      = false;
+}
 
-    if (!(buf[bufsize - 5] == 'E'  &&
-          buf[bufsize - 4] == 'N'  &&
-          buf[bufsize - 3] == 'D'  &&
-          buf[bufsize - 2] == '\r' &&
-          buf[bufsize - 1] == '\n'))
+/**
+ * queue the kind of response for the request at the head of buf.
+ * nothing is queued for noreply.
+ */
+void na_memproto_res_parser_expect (na_memproto_res_parser_t *parser, na_memproto_cmd_t cmd, const char *buf, int bufsize)
+{
+    const char *nl;
+
+    nl = na_scan_byte(buf, bufsize, '\n');
+    if (nl == NULL || parser->kind_cnt >= NA_MEMPROTO_PIPELINE_MAX) {
+        return;
+    }
+
+    if (cmd == NA_MEMPROTO_CMD_GET) {
+        parser->kinds[parser->kind_cnt++] = NA_MEMPROTO_RES_KIND_VALUES;
+    } else if (cmd == NA_MEMPROTO_CMD_META) {
+        parser->kinds[parser->kind_cnt++] = NA_MEMPROTO_RES_KIND_META;
+    } else if (!na_memproto_is_noreply(buf, nl - buf + 1)) {
+        parser->kinds[parser->kind_cnt++] = NA_MEMPROTO_RES_KIND_LINE;
+    }
+}
+
+/**
+ * the first request line of buf ends with noreply.
+ */
+bool na_memproto_request_is_noreply (const char *buf, int bufsize)
+{
+    const char *nl;
+
+    nl = na_scan_byte(buf, bufsize, '\n');
+
+    return nl != NULL && na_memproto_is_noreply(buf, nl - buf + 1);
+}
+
+/**
+ * split complete requests at the head of buf for pipelining and queue
+ * the kinds of their responses in order. framing stops before quit,
+ * an incomplete request or when NA_MEMPROTO_PIPELINE_MAX responses are queued.
+ * when a meta command with the q flag or a noreply request among others
+ * is framed, is_barrier is set and the caller appends a private mn.
+ * the responses are then counted by MN.
+ * returns the bytes of framed requests or -1 when a request is malformed or unknown.
+ */
+int na_memproto_frame_requests (na_memproto_res_parser_t *parser, const char *buf, int bufsize)
+{
+    const char *p, *nl;
+    int framed, rest, mn_cnt;
+    long size;
+    bool is_quiet, is_noreply;
+    na_memproto_cmd_t cmd;
+
+    framed     = 0;
+    mn_cnt     = 0;
+    is_quiet   = false;
+    is_noreply = false;
+    while (framed < bufsize && parser->kind_cnt < NA_MEMPROTO_PIPELINE_MAX) {
+        p    = buf + framed;
+        rest = bufsize - framed;
+        nl   = na_scan_byte(p, rest, '\n');
+        if (nl == NULL) {
+            if (rest > NA_MEMPROTO_LINE_MAX) {
+                return -1;
+            }
+            break; // not ready yet
+        }
+        if (nl == p || nl[-1] != '\r') {
+            return -1;
+        }
+
+        cmd = na_memproto_detect_command((char *)p);
+        switch (cmd) {
+        case NA_MEMPROTO_CMD_SET:
+        case NA_MEMPROTO_CMD_ADD:
+            size = na_memproto_storage_request_size(p, rest);
+            if (size < 0) {
+                return -1;
+            }
+            break;
+        case NA_MEMPROTO_CMD_GET:
+        case NA_MEMPROTO_CMD_INCR:
+        case NA_MEMPROTO_CMD_DECR:
+        case NA_MEMPROTO_CMD_DELETE:
+            size = nl - p + 1;
+            break;
+        case NA_MEMPROTO_CMD_META:
+            if (p[1] == 's') {
+                size = na_memproto_meta_set_size(p, nl);
+                if (size < 0) {
+                    return -1;
+                }
+            } else {
+                size = nl - p + 1;
+            }
+            break;
+        case NA_MEMPROTO_CMD_QUIT:
+            size = 0;
+            break;
+        default:
+            return -1;
+        }
+
+        if (size == 0 || size > rest) {
+            break; // quit or not ready yet
+        }
+
+        if (cmd == NA_MEMPROTO_CMD_META) {
+            if (na_memproto_meta_is_quiet(p, nl - 1)) {
+                is_quiet = true;
+            } else if (p[1] == 'n') {
+                ++mn_cnt;
+            }
+        } else if (na_memproto_is_noreply(p, nl - p + 1)) {
+            is_noreply = true;
+        }
+        na_memproto_res_parser_expect(parser, cmd, p, rest);
+        framed += size;
+    }
+
+    // an error of a noreply request would be taken for the response of the next request
+    if (is_quiet || (is_noreply && parser->kind_cnt > 0)) {
+        // the responses end with MN of the barrier
+        parser->is_barrier = true;
+        parser->kind_cnt   = mn_cnt + 1;
+    }
+
+    return framed;
+}
+
+/**
+ * n bytes at the head of the buffer were discarded.
+ */
+void na_memproto_res_parser_shift (na_memproto_res_parser_t *parser, int n)
+{
+    parser->offset -= n;
+    parser->line    = parser->line > n ? parser->line - n : 0;
+}
+
+/**
+ * the first byte which must be kept in the buffer for parsing.
+ */
+int na_memproto_res_parser_keep (na_memproto_res_parser_t *parser)
+{
+    if (parser->state == NA_MEMPROTO_PARSE_STATE_LINE) {
+        return parser->line;
+    }
+    return parser->offset;
+}
+
+/**
+ * parse responses of get incrementally.
+ * bytes parsed by the previous call are not examined again.
+ * returns the number of terminated responses or -1 when the response is malformed.
+ */
+int na_memproto_res_parse (na_memproto_res_parser_t *parser, const char *buf, int bufsize)
+{
+    const char *nl;
+    size_t n;
+
+    while (parser->offset < bufsize) {
+        switch (parser->state) {
+        case NA_MEMPROTO_PARSE_STATE_LINE:
+            nl = na_scan_byte(buf + parser->offset, bufsize - parser->offset, '\n');
+            if (nl == NULL) {
+                parser->offset = bufsize;
+                if (parser->offset - parser->line > NA_MEMPROTO_LINE_MAX) {
+                    parser->state = NA_MEMPROTO_PARSE_STATE_ERROR;
+                    return -1;
+                }
+                return parser->end_cnt;
+            }
+            parser->offset = nl - buf + 1;
+            if (!na_memproto_res_line_parse(parser, buf + parser->line, parser->offset - parser->line)) {
+                parser->state = NA_MEMPROTO_PARSE_STATE_ERROR;
+                return -1;
+            }
+            parser->line = parser->offset;
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA:
+            n = bufsize - parser->offset;
+            if (n > parser->remain) {
+                n = parser->remain;
+            }
+            parser->offset += n;
+            parser->remain -= n;
+            if (parser->remain == 0) {
+                parser->state = NA_MEMPROTO_PARSE_STATE_DATA_CR;
+            }
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA_CR:
+            if (buf[parser->offset++] != '\r') {
+                parser->state = NA_MEMPROTO_PARSE_STATE_ERROR;
+                return -1;
+            }
+            parser->state = NA_MEMPROTO_PARSE_STATE_DATA_LF;
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA_LF:
+            if (buf[parser->offset++] != '\n') {
+                parser->state = NA_MEMPROTO_PARSE_STATE_ERROR;
+                return -1;
+            }
+            parser->state = NA_MEMPROTO_PARSE_STATE_LINE;
+            parser->line  = parser->offset;
+            if (parser->is_value_end) {
+                parser->is_value_end = false;
+                parser->end_cnt++;
+            }
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return parser->end_cnt;
+}
+
+static uint32_t na_memproto_bin_be32 (const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/**
+ * quiet commands of the binary protocol. they respond only on a hit(getq, getkq)
+ * or on an error(others), so their responses are not counted.
+ */
+static bool na_memproto_bin_is_quiet (int opcode)
+{
+    switch (opcode) {
+    case 0x09: // getq
+    case 0x0d: // getkq
+    case 0x11: // setq
+    case 0x12: // addq
+    case 0x13: // replaceq
+    case 0x14: // deleteq
+    case 0x15: // incrementq
+    case 0x16: // decrementq
+    case 0x17: // quitq
+    case 0x18: // flushq
+    case 0x19: // appendq
+    case 0x1a: // prependq
+    case 0x1e: // gatq
+    case 0x24: // gatkq
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void na_memproto_bin_packet_end (na_memproto_res_parser_t *parser)
+{
+    if (!na_memproto_bin_is_quiet(parser->opcode)) {
+        parser->end_cnt++;
+    }
+    parser->state = NA_MEMPROTO_PARSE_STATE_LINE;
+    parser->line  = parser->offset;
+}
+
+/**
+ * split complete packets of the binary protocol at the head of buf.
+ * packets are framed by the total body length in the fixed header.
+ * a packet which is not quiet is counted as an expected response. when the
+ * last framed packet is quiet, is_barrier is set and the caller appends
+ * a private noop so that the end of the responses is known.
+ * returns the bytes of framed packets or -1 when a packet is malformed.
+ */
+int na_memproto_bin_frame_requests (na_memproto_res_parser_t *parser, const char *buf, int bufsize)
+{
+    const unsigned char *p;
+    uint32_t bodylen;
+    int framed, keylen, extlen;
+    bool is_quiet;
+
+    framed             = 0;
+    is_quiet           = false;
+    parser->is_barrier = false;
+    while (bufsize - framed >= NA_MEMPROTO_BIN_HEADER_SIZE &&
+           parser->kind_cnt < NA_MEMPROTO_PIPELINE_MAX - 1)
     {
-        return 0;
-    } else {
-        if (bufsize == sizeof("END\r\n") - 1) {
-            return 1;
+        p = (const unsigned char *)buf + framed;
+        if (p[0] != NA_MEMPROTO_BIN_MAGIC_REQUEST) {
+            return -1;
+        }
+        if (p[1] == NA_MEMPROTO_BIN_OPCODE_QUIT || p[1] == NA_MEMPROTO_BIN_OPCODE_QUITQ) {
+            break;
+        }
+
+        keylen  = (p[2] << 8) | p[3];
+        extlen  = p[4];
+        bodylen = na_memproto_bin_be32(p + 8);
+        if (bodylen > NA_MEMPROTO_BIN_BODY_MAX || (uint32_t)(keylen + extlen) > bodylen) {
+            return -1;
+        }
+        if (bodylen > (uint32_t)(bufsize - framed - NA_MEMPROTO_BIN_HEADER_SIZE)) {
+            break; // not ready yet
+        }
+
+        is_quiet = na_memproto_bin_is_quiet(p[1]);
+        if (!is_quiet) {
+            parser->kinds[parser->kind_cnt++] = NA_MEMPROTO_RES_KIND_PACKET;
         }
+        framed += NA_MEMPROTO_BIN_HEADER_SIZE + bodylen;
     }
 
-    p = buf;
-    i = 0;
- count:
-    c = 0;
-    while (c != 3) {
-        if (*p == ' ') {
-            c++;
+    if (framed > 0 && is_quiet) {
+        parser->kinds[parser->kind_cnt++] = NA_MEMPROTO_RES_KIND_PACKET;
+        parser->is_barrier                = true;
+    }
+
+    return framed;
+}
+
+/**
+ * parse responses of the binary protocol incrementally.
+ * returns the number of responses which are not quiet or -1 when the response is malformed.
+ */
+int na_memproto_bin_res_parse (na_memproto_res_parser_t *parser, const char *buf, int bufsize)
+{
+    const unsigned char *p;
+    uint32_t bodylen;
+    size_t n;
+
+    while (parser->offset < bufsize) {
+        switch (parser->state) {
+        case NA_MEMPROTO_PARSE_STATE_LINE:
+            if (bufsize - parser->line < NA_MEMPROTO_BIN_HEADER_SIZE) {
+                parser->offset = bufsize;
+                return parser->end_cnt;
+            }
+            p = (const unsigned char *)buf + parser->line;
+            bodylen = na_memproto_bin_be32(p + 8);
+            if (p[0] != NA_MEMPROTO_BIN_MAGIC_RESPONSE || bodylen > NA_MEMPROTO_BIN_BODY_MAX) {
+                parser->state = NA_MEMPROTO_PARSE_STATE_ERROR;
+                return -1;
+            }
+            parser->opcode = p[1];
+            parser->remain = bodylen;
+            parser->offset = parser->line + NA_MEMPROTO_BIN_HEADER_SIZE;
+            if (parser->remain == 0) {
+                na_memproto_bin_packet_end(parser);
+            } else {
+                parser->state = NA_MEMPROTO_PARSE_STATE_DATA;
+            }
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA:
+            n = bufsize - parser->offset;
+            if (n > parser->remain) {
+                n = parser->remain;
+            }
+            parser->offset += n;
+            parser->remain -= n;
+            if (parser->remain == 0) {
+                na_memproto_bin_packet_end(parser);
+            }
+            break;
+        default:
+            return -1;
         }
-        i++;
-        if (i >= bufsize) {
-            return count;
+    }
+
+    return parser->end_cnt;
+}
+
+/**
+ * the private request appended after quiet requests.
+ */
+const char *na_memproto_barrier (na_memproto_cmd_t cmd, int *size)
+{
+    if (cmd == NA_MEMPROTO_CMD_BINARY) {
+        *size = NA_MEMPROTO_BIN_HEADER_SIZE;
+        return NA_MEMPROTO_BIN_BARRIER;
+    }
+    *size = strlen(NA_MEMPROTO_META_BARRIER);
+    return NA_MEMPROTO_META_BARRIER;
+}
+
+/**
+ * remove the response of the barrier at the tail of the responses.
+ */
+bool na_memproto_barrier_strip (na_memproto_cmd_t cmd, const char *buf, int *bufsize)
+{
+    const unsigned char *p;
+
+    if (cmd != NA_MEMPROTO_CMD_BINARY) {
+        if (*bufsize < 4 || memcmp(buf + *bufsize - 4, "MN\r\n", 4) != 0) {
+            return false;
         }
-        p++;
+        *bufsize -= 4;
+        return true;
     }
 
-    j = 0;
-    while (*p != '\n') {
-        sizbuf[j++] = *p++;
-        i++;
+    if (*bufsize < NA_MEMPROTO_BIN_HEADER_SIZE) {
+        return false;
     }
-    if (i >= bufsize) {
-        return count;
+
+    p = (const unsigned char *)buf + *bufsize - NA_MEMPROTO_BIN_HEADER_SIZE;
+    if (p[0] != NA_MEMPROTO_BIN_MAGIC_RESPONSE || p[1] != NA_MEMPROTO_BIN_OPCODE_NOOP ||
+        na_memproto_bin_be32(p + 8) != 0 ||
+        memcmp(p + 12, NA_MEMPROTO_BIN_BARRIER + 12, 4) != 0)
+    {
+        return false;
     }
-    sizbuf[j] = '\0';
-    int size = atoi(sizbuf);
-    p += size + 3;
-    i += size + 3;
-    if (i >= bufsize) {
-        return count;
+    *bufsize -= NA_MEMPROTO_BIN_HEADER_SIZE;
+
+    return true;
+}
+
+/**
+ * skip replies to noreply requests(errors only) up to MN of the barriers
+ * sent after them. *match carries the bytes of MN matched at the head of
+ * the line across calls and is -1 in the middle of other line.
+ * *mn_cnt is decreased by each MN and skipping stops at zero.
+ * returns the bytes skipped.
+ */
+int na_memproto_noreply_skip (const char *buf, int bufsize, int *mn_cnt, int *match, int *error_cnt)
+{
+    const char *p, *end, *nl;
+
+    p   = buf;
+    end = buf + bufsize;
+    while (p < end && *mn_cnt > 0) {
+        if (*match < 0) {
+            nl = na_scan_byte(p, end - p, '\n');
+            if (nl == NULL) {
+                return bufsize; // the rest of the line is not received yet
+            }
+            ++*error_cnt;
+            *match = 0;
+            p      = nl + 1;
+        } else if (*p != "MN\r\n"[*match]) {
+            *match = -1;
+        } else if (++*match == 4) {
+            --*mn_cnt;
+            *match = 0;
+            ++p;
+        } else {
+            ++p;
+        }
+    }
+
+    return p - buf;
+}
+
+/**
+ * copy the key into key when buf is exactly a get of a single key.
+ */
+bool na_memproto_get_key (const char *buf, int bufsize, char *key)
+{
+    int len;
+
+    if (bufsize < 7 || memcmp(buf, "get ", 4) != 0 ||
+        buf[bufsize - 2] != '\r' || buf[bufsize - 1] != '\n')
+    {
+        return false;
+    }
+
+    len = bufsize - 6;
+    if (len > NA_MEMPROTO_KEY_MAX ||
+        na_scan_byte(buf + 4, len, ' ') != NULL || na_scan_byte(buf + 4, len, '\n') != NULL)
+    {
+        return false;
+    }
+
+    memcpy(key, buf + 4, len);
+    key[len] = '\0';
+
+    return true;
+}
+
+/**
+ * size of the request at the head of buf and its key.
+ * the key is the second token of a text or meta request line.
+ * keylen is 0 when the request has no key(e.g. mn, noop).
+ * the size exceeds bufsize while the data block is arriving.
+ * returns -1 when the request is malformed.
+ */
+int na_memproto_request_key (na_memproto_cmd_t cmd, const char *buf, int bufsize, const char **key, int *keylen)
+{
+    const unsigned char *p;
+    const char *nl, *k;
+    long size;
+
+    *keylen = 0;
+
+    if (cmd == NA_MEMPROTO_CMD_BINARY) {
+        if (bufsize < NA_MEMPROTO_BIN_HEADER_SIZE) {
+            return -1;
+        }
+        p    = (const unsigned char *)buf;
+        size = NA_MEMPROTO_BIN_HEADER_SIZE + (long)na_memproto_bin_be32(p + 8);
+        *key    = buf + NA_MEMPROTO_BIN_HEADER_SIZE + p[4];
+        *keylen = (p[2] << 8) | p[3];
+        return size;
+    }
+
+    nl = na_scan_byte(buf, bufsize, '\n');
+    if (nl == NULL || nl == buf) {
+        return -1;
     }
 
-    if (strncmp("END\r\n", p, sizeof("END\r\n") - 1) == 0) {
-        count++;
-        i += sizeof("END\r\n") - 1;
-        p += sizeof("END\r\n") - 1;
-        if (i >= bufsize) {
-            return count;
+    switch (na_memproto_detect_command((char *)buf)) {
+    case NA_MEMPROTO_CMD_SET:
+    case NA_MEMPROTO_CMD_ADD:
+        size = na_memproto_storage_request_size(buf, bufsize);
+        break;
+    case NA_MEMPROTO_CMD_META:
+        size = buf[1] == 's' ? na_memproto_meta_set_size(buf, nl) : nl - buf + 1;
+        break;
+    default:
+        size = nl - buf + 1;
+        break;
+    }
+    if (size <= 0) {
+        return -1;
+    }
+
+    k = na_scan_byte(buf, nl - buf - 1, ' ');
+    if (k != NULL) {
+        *key = ++k;
+        while (k < nl - 1 && *k != ' ') {
+            ++k;
         }
-        goto count;
-    } else {
-        goto count;
+        *keylen = k - *key;
     }
-    //return na_bm_search(buf, "END\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_ENDCRLF], bufsize, 5);
+
+    return size;
 }
@@ -10,73 +10,238 @@
 
 #include "defines.h"
 
+/**
+ * The queue implemented here is a bounded lock-free MPMC ring
+ * based on Dmitry Vyukov's algorithm. Each cell carries a sequence
+ * number which tells producers and consumers whose turn it is,
+ * so neither side ever takes a lock or blocks.
+ */
+
+static inline uint64_t na_event_queue_now(void);
+static size_t na_event_queue_capacity(int c);
+
+static inline uint64_t na_event_queue_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static size_t na_event_queue_capacity(int c)
+{
+    size_t capacity = 2;
+    while (capacity < (size_t)c) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
 na_event_queue_t *na_event_queue_create(int c)
 {
     na_event_queue_t *q;
-    q        = malloc(sizeof(na_event_queue_t));
-    q->top   = 0;
-    q->bot   = 0;
-    q->cnt   = 0;
-    q->max   = c;
-    q->queue = calloc(sizeof(na_client_t *), c);
-    for (int i=0;i<c;++i) {
-        q->queue[i] = (na_client_t *)NULL;
+    size_t capacity;
+
+    capacity = na_event_queue_capacity(c);
+    q        = calloc(1, sizeof(na_event_queue_t));
+    q->cells = calloc(sizeof(na_event_queue_cell_t), capacity);
+    q->max   = capacity;
+    q->mask  = capacity - 1;
+    for (size_t i=0;i<capacity;++i) {
+        atomic_init(&q->cells[i].seq, i);
+        q->cells[i].client = NULL;
     }
-    pthread_mutex_init(&q->lock, NULL);
-    pthread_cond_init (&q->cond, NULL);
+    atomic_init(&q->enqueue_pos,   0);
+    atomic_init(&q->dequeue_pos,   0);
+    atomic_init(&q->overflow_cnt,  0);
+    atomic_init(&q->pop_cnt,       0);
+    atomic_init(&q->wait_nsec_sum, 0);
+    atomic_init(&q->wait_nsec_max, 0);
     return q;
 }
 
 void na_event_queue_destroy(na_event_queue_t *q)
 {
-    pthread_mutex_destroy(&q->lock);
-    pthread_cond_destroy(&q->cond);
-    NA_FREE(q->queue);
+    NA_FREE(q->cells);
     NA_FREE(q);
 }
 
 bool na_event_queue_push(na_event_queue_t *q, na_client_t *e)
 {
-    pthread_mutex_lock(&q->lock);
-    if (q->cnt >= q->max) {
-        pthread_mutex_unlock(&q->lock);
-        return false;
+    na_event_queue_cell_t *cell;
+    size_t pos, seq;
+    intptr_t dif;
+
+    pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif  = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&q->overflow_cnt, 1, memory_order_relaxed);
+            return false; // full
+        } else {
+            pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->client   = e;
+    cell->enqueued = na_event_queue_now();
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+na_client_t *na_event_queue_pop(na_event_queue_t *q)
+{
+    na_event_queue_cell_t *cell;
+    na_client_t *c;
+    size_t pos, seq;
+    intptr_t dif;
+    uint64_t wait, wait_max;
+
+    pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        dif  = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL; // empty
+        } else {
+            pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+        }
     }
 
-    q->queue[q->bot++] = e;
+    c    = cell->client;
+    wait = na_event_queue_now() - cell->enqueued;
+    cell->client = NULL;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&q->pop_cnt,       1,    memory_order_relaxed);
+    atomic_fetch_add_explicit(&q->wait_nsec_sum, wait, memory_order_relaxed);
+    wait_max = atomic_load_explicit(&q->wait_nsec_max, memory_order_relaxed);
+    while (wait > wait_max &&
+           !atomic_compare_exchange_weak_explicit(&q->wait_nsec_max, &wait_max, wait,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+        ; // retry with the refreshed wait_max
+    }
+
+    return c;
+}
+
+size_t na_event_queue_depth(na_event_queue_t *q)
+{
+    size_t enqueue_pos, dequeue_pos;
+
+    dequeue_pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    enqueue_pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
+
+/**
+ * The deque implemented here is a bounded Chase-Lev work-stealing deque
+ * (with the C11 memory orderings by Le, Pop, Cohen and Zappa Nardelli).
+ * Only the owner worker pushes and pops at the bottom,
+ * other workers steal from the top without taking a lock.
+ */
+
+na_event_deque_t *na_event_deque_create(int c)
+{
+    na_event_deque_t *d;
+    size_t capacity;
 
-    if (q->bot >= q->max) {
-        q->bot = 0;
+    capacity = na_event_queue_capacity(c);
+    d        = calloc(1, sizeof(na_event_deque_t));
+    d->cells = calloc(sizeof(*d->cells), capacity);
+    d->max   = capacity;
+    d->mask  = capacity - 1;
+    for (size_t i=0;i<capacity;++i) {
+        atomic_init(&d->cells[i], NULL);
     }
+    atomic_init(&d->top,    0);
+    atomic_init(&d->bottom, 0);
+    return d;
+}
+
+void na_event_deque_destroy(na_event_deque_t *d)
+{
+    NA_FREE(d->cells);
+    NA_FREE(d);
+}
 
-    ++q->cnt;
+bool na_event_deque_push(na_event_deque_t *d, na_client_t *e)
+{
+    long b, t;
 
-    if (q->cnt == 1) {
-        pthread_cond_broadcast(&q->cond);
+    b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    t = atomic_load_explicit(&d->top,    memory_order_acquire);
+    if (b - t >= (long)d->max) {
+        return false; // full
     }
 
-    pthread_mutex_unlock(&q->lock);
+    atomic_store_explicit(&d->cells[b & d->mask], e, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+
     return true;
 }
 
-na_client_t *na_event_queue_pop(na_event_queue_t *q)
+na_client_t *na_event_deque_pop(na_event_deque_t *d)
 {
     na_client_t *c;
-    pthread_mutex_lock(&q->lock);
-    if (q->cnt <= 0) {
-        pthread_mutex_unlock(&q->lock);
-        return NULL;
+    long b, t;
+
+    b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL; // empty
+    }
+
+    c = atomic_load_explicit(&d->cells[b & d->mask], memory_order_relaxed);
+    if (t == b) {
+        // the last one, race against thieves
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            c = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
     }
 
-    c = q->queue[q->top];
-    q->queue[q->top++] = 0;
+    return c;
+}
 
-    if (q->top >= q->max) {
-        q->top = 0;
+na_client_t *na_event_deque_steal(na_event_deque_t *d)
+{
+    na_client_t *c;
+    long b, t;
+
+    t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return NULL; // empty
     }
 
-    --q->cnt;
+    c = atomic_load_explicit(&d->cells[t & d->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL; // lost the race against the owner or another thief
+    }
 
-    pthread_mutex_unlock(&q->lock);
     return c;
 }
@@ -0,0 +1,240 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NA_SCAN_X86
+#include <immintrin.h>
+#endif
+
+/**
+ * scanners for CRLF and delimiters in requests and responses.
+ * the kernel is selected by na_scan_init() from the features of the cpu.
+ */
+
+// private functions
+static int na_scan_count_crlf_scalar (const char *buf, int len, int carry);
+static const char *na_scan_byte_scalar (const char *buf, int len, char c);
+#ifdef NA_SCAN_X86
+static int na_scan_count_crlf_sse2 (const char *buf, int len);
+static const char *na_scan_byte_sse2 (const char *buf, int len, char c);
+static int na_scan_count_crlf_avx2 (const char *buf, int len);
+static const char *na_scan_byte_avx2 (const char *buf, int len, char c);
+#endif
+static int na_scan_count_crlf_generic (const char *buf, int len);
+static const char *na_scan_byte_generic (const char *buf, int len, char c);
+
+static int (*na_scan_count_crlf_kernel)(const char *buf, int len)            = na_scan_count_crlf_generic;
+static const char *(*na_scan_byte_kernel)(const char *buf, int len, char c) = na_scan_byte_generic;
+static na_scan_kernel_t na_scan_kernel = NA_SCAN_KERNEL_SCALAR;
+
+static const char *na_scan_kernel_names[NA_SCAN_KERNEL_MAX] = {
+    [NA_SCAN_KERNEL_SCALAR] = "scalar",
+    [NA_SCAN_KERNEL_SSE2]   = "sse2",
+    [NA_SCAN_KERNEL_AVX2]   = "avx2",
+};
+
+/**
+ * carry is 1 when the byte before buf is CR.
+ */
+static int na_scan_count_crlf_scalar (const char *buf, int len, int carry)
+{
+    int c;
+
+    c = 0;
+    if (len > 0 && carry && buf[0] == '\n') {
+        ++c;
+    }
+    for (int i=1;i<len;++i) {
+        if (buf[i] == '\n' && buf[i - 1] == '\r') {
+            ++c;
+        }
+    }
+
+    return c;
+}
+
+static const char *na_scan_byte_scalar (const char *buf, int len, char c)
+{
+    for (int i=0;i<len;++i) {
+        if (buf[i] == c) {
+            return buf + i;
+        }
+    }
+    return NULL;
+}
+
+static int na_scan_count_crlf_generic (const char *buf, int len)
+{
+    return na_scan_count_crlf_scalar(buf, len, 0);
+}
+
+static const char *na_scan_byte_generic (const char *buf, int len, char c)
+{
+    return memchr(buf, c, len);
+}
+
+#ifdef NA_SCAN_X86
+
+/**
+ * a bit of CR in a block is shifted onto the bit of the next byte
+ * and matched with the bits of LF. the last bit of CR is carried
+ * to the next block.
+ */
+__attribute__((target("sse2")))
+static int na_scan_count_crlf_sse2 (const char *buf, int len)
+{
+    __m128i cr, lf, v;
+    uint32_t mcr, mlf, carry;
+    int i, c;
+
+    cr    = _mm_set1_epi8('\r');
+    lf    = _mm_set1_epi8('\n');
+    carry = 0;
+    c     = 0;
+    for (i=0;i+16<=len;i+=16) {
+        v     = _mm_loadu_si128((const __m128i *)(buf + i));
+        mcr   = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+        mlf   = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+        c    += __builtin_popcount(((mcr << 1) | carry) & mlf);
+        carry = mcr >> 15;
+    }
+
+    return c + na_scan_count_crlf_scalar(buf + i, len - i, carry);
+}
+
+__attribute__((target("sse2")))
+static const char *na_scan_byte_sse2 (const char *buf, int len, char c)
+{
+    __m128i n, v;
+    uint32_t m;
+    int i;
+
+    n = _mm_set1_epi8(c);
+    for (i=0;i+16<=len;i+=16) {
+        v = _mm_loadu_si128((const __m128i *)(buf + i));
+        m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, n));
+        if (m != 0) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+
+    return na_scan_byte_scalar(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static int na_scan_count_crlf_avx2 (const char *buf, int len)
+{
+    __m256i cr, lf, v;
+    uint64_t mcr, mlf, carry;
+    int i, c;
+
+    cr    = _mm256_set1_epi8('\r');
+    lf    = _mm256_set1_epi8('\n');
+    carry = 0;
+    c     = 0;
+    for (i=0;i+32<=len;i+=32) {
+        v     = _mm256_loadu_si256((const __m256i *)(buf + i));
+        mcr   = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+        mlf   = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        c    += __builtin_popcountll(((mcr << 1) | carry) & mlf);
+        carry = mcr >> 31;
+    }
+
+    return c + na_scan_count_crlf_scalar(buf + i, len - i, carry);
+}
+
+__attribute__((target("avx2")))
+static const char *na_scan_byte_avx2 (const char *buf, int len, char c)
+{
+    __m256i n, v;
+    uint32_t m;
+    int i;
+
+    n = _mm256_set1_epi8(c);
+    for (i=0;i+32<=len;i+=32) {
+        v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, n));
+        if (m != 0) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+
+    return na_scan_byte_scalar(buf + i, len - i, c);
+}
+
+#endif
+
+void na_scan_init (void)
+{
+    if (na_scan_kernel_set(NA_SCAN_KERNEL_AVX2) || na_scan_kernel_set(NA_SCAN_KERNEL_SSE2)) {
+        return;
+    }
+    na_scan_kernel_set(NA_SCAN_KERNEL_SCALAR);
+}
+
+/**
+ * returns false when the cpu does not support the kernel(misc/scanbench compares them).
+ */
+bool na_scan_kernel_set (na_scan_kernel_t kernel)
+{
+    switch (kernel) {
+#ifdef NA_SCAN_X86
+    case NA_SCAN_KERNEL_AVX2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("avx2")) {
+            return false;
+        }
+        na_scan_count_crlf_kernel = na_scan_count_crlf_avx2;
+        na_scan_byte_kernel       = na_scan_byte_avx2;
+        break;
+    case NA_SCAN_KERNEL_SSE2:
+        __builtin_cpu_init();
+        if (!__builtin_cpu_supports("sse2")) {
+            return false;
+        }
+        na_scan_count_crlf_kernel = na_scan_count_crlf_sse2;
+        na_scan_byte_kernel       = na_scan_byte_sse2;
+        break;
+#endif
+    case NA_SCAN_KERNEL_SCALAR:
+        na_scan_count_crlf_kernel = na_scan_count_crlf_generic;
+        na_scan_byte_kernel       = na_scan_byte_generic;
+        break;
+    default:
+        return false;
+    }
+    na_scan_kernel = kernel;
+
+    return true;
+}
+
+const char *na_scan_kernel_name (void)
+{
+    return na_scan_kernel_names[na_scan_kernel];
+}
+
+/**
+ * number of CRLF in buf.
+ */
+int na_scan_count_crlf (const char *buf, int len)
+{
+    return na_scan_count_crlf_kernel(buf, len);
+}
+
+/**
+ * the first c in buf or NULL.
+ */
+const char *na_scan_byte (const char *buf, int len, char c)
+{
+    return na_scan_byte_kernel(buf, len, c);
+}
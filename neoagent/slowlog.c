@@ -37,7 +37,9 @@ static int clock_gettime(int dummy, struct timespec *ts)
 static void na_copy_querytxt(char *dst, char *src, size_t size, size_t reqsize, na_memproto_cmd_t cmd);
 static void na_copy_querytxt(char *dst, char *src, size_t size, size_t reqsize, na_memproto_cmd_t cmd)
 {
-    if (cmd == NA_MEMPROTO_CMD_SET) {
+    if (cmd == NA_MEMPROTO_CMD_BINARY) {
+        snprintf(dst, size, "binary opcode 0x%02x", (unsigned char)src[1]);
+    } else if (cmd == NA_MEMPROTO_CMD_SET) {
         char *p;
         p = src + sizeof("set ") - 1;
         p = strstr(p, " ");
@@ -95,7 +97,9 @@ void na_slow_query_check(na_client_t *client)
                    na_from_ts   = (double)((double)na_from_ts_time.tv_sec   + (double)na_from_ts_time.tv_nsec / 1000000000L),
                    na_to_client = (double)((double)na_to_client_time.tv_sec + (double)na_to_client_time.tv_nsec / 1000000000L);
 
-            client->crbuf[client->crbufsize - 2] = '\0'; // don't want newline
+            if (client->cmd != NA_MEMPROTO_CMD_BINARY && client->crbufsize >= 2) {
+                client->crbuf[client->crbufsize - 2] = '\0'; // don't want newline
+            }
             if (env->slow_query_log_format == NA_LOG_FORMAT_JSON) {
                 struct json_object *json;
                 const size_t bufsz = 128;
@@ -123,7 +127,8 @@ void na_slow_query_check(na_client_t *client)
                         "na->ts %g na<-ts %g na->c %g querytxt \"%.128s\" "
                         "request_bufsize %d, response_bufsize %d\n",
                         now, env->name, host, clientaddr, clientport, 
-                        na_to_ts, na_from_ts, na_to_client, client->crbuf, 
+                        na_to_ts, na_from_ts, na_to_client,
+                        client->cmd == NA_MEMPROTO_CMD_BINARY ? "binary" : client->crbuf,
                         client->crbufsize, client->cwbufsize);
             }
         }
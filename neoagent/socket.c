@@ -16,6 +16,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
 #include "defines.h"
 
@@ -39,6 +42,9 @@ static void na_set_sockopt(int fd, int optname)
     switch (optname) {
     case SO_KEEPALIVE:
     case SO_REUSEADDR:
+#ifdef SO_REUSEPORT
+    case SO_REUSEPORT:
+#endif
         {
             int flags = 1;
             setsockopt(fd, SOL_SOCKET, optname, (void *)&flags, sizeof(flags));
@@ -86,6 +92,32 @@ int na_server_accept (int sfd)
     return cfd;
 }
 
+/**
+ * accept up to max connections until the backlog is drained.
+ * accepted sockets are already non-blocking and close-on-exec.
+ */
+int na_server_accept_batch (int sfd, int *cfds, int max)
+{
+    int cnt;
+
+    for (cnt=0;cnt<max;++cnt) {
+#if defined(__linux__) && defined(SOCK_NONBLOCK)
+        cfds[cnt] = accept4(sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        cfds[cnt] = accept(sfd, NULL, NULL);
+        if (cfds[cnt] >= 0) {
+            na_set_nonblock(cfds[cnt]);
+            fcntl(cfds[cnt], F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (cfds[cnt] < 0) {
+            break;
+        }
+    }
+
+    return cnt;
+}
+
 int na_target_server_tcpsock_init (void)
 {
     int tsfd;
@@ -127,7 +159,7 @@ na_host_t na_create_host(char *host)
     // 192.168.0.11:11211, example.com:20001
     na_host_t host_info;
     char *p;
-    int16_t port;
+    int port;
     int hostname_len = 0;
 
     p = host;
@@ -150,7 +182,7 @@ na_host_t na_create_host(char *host)
 
     port = atoi(p);
 
-    if (port <= 0) {
+    if (port <= 0 || port > UINT16_MAX) {
         NA_DIE_WITH_ERROR(NULL, NA_ERROR_INVALID_PORT);
     }
 
@@ -213,7 +245,7 @@ void na_set_sockaddr (na_host_t *host, struct sockaddr_in *addr)
     }
 }
 
-int na_front_server_tcpsock_init (uint16_t port, int conn_max)
+int na_front_server_tcpsock_init (uint16_t port, int conn_max, bool is_reuseport)
 {
     int fsfd;
     struct sockaddr_in iaddr;
@@ -228,6 +260,16 @@ int na_front_server_tcpsock_init (uint16_t port, int conn_max)
     na_set_sockopt(fsfd, SO_REUSEADDR);
     na_set_sockopt(fsfd, SO_LINGER);
 
+    if (is_reuseport) {
+#ifdef SO_REUSEPORT
+        na_set_sockopt(fsfd, SO_REUSEPORT);
+#else
+        close(fsfd);
+        NA_ERROR_OUTPUT(NULL, "SO_REUSEPORT is not supported");
+        return -1;
+#endif
+    }
+
     if (port > 0) {
         memset(&iaddr, 0, sizeof(iaddr));
         iaddr.sin_family      = AF_INET;
@@ -253,6 +295,33 @@ int na_front_server_tcpsock_init (uint16_t port, int conn_max)
     return fsfd;
 }
 
+/**
+ * attach a classic BPF program to the reuseport group of fsfd.
+ * the program steers each connection to the listener
+ * whose index equals the receiving CPU modulo group_size.
+ */
+bool na_front_server_reuseport_cbpf_attach (int fsfd, int group_size)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_W   | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU }, // A = current cpu
+        { BPF_ALU | BPF_MOD | BPF_K,   0, 0, group_size },              // A = A % group_size
+        { BPF_RET | BPF_A,             0, 0, 0 },                       // return A
+    };
+    struct sock_fprog prog = {
+        .len    = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (setsockopt(fsfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 int na_front_server_unixsock_init (char *sockpath, mode_t mask, int conn_max)
 {
     int fsfd;
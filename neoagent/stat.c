@@ -13,7 +13,7 @@
 #include "version.h"
 
 // constants
-static const int   NA_STAT_BUF_MAX   = 8192;
+static const int   NA_STAT_BUF_MAX   = 16384;
 static const char *NA_BOOL_STR_TRUE  = "true";
 static const char *NA_BOOL_STR_FALSE = "false";
 
@@ -30,6 +30,15 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env);
 static int na_available_conn (na_connpool_t *connpool);
 static struct json_object *na_connpoolmap_array_json(na_connpool_t *connpool);
 static struct json_object *na_workermap_array_json(na_env_t *env);
+static struct json_object *na_queuemap_array_json(na_env_t *env);
+static void na_queue_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_steal_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_collapse_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_batch_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_noreply_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_target_servers_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_fanout_stat_add(struct json_object *stat_obj, na_env_t *env);
+static void na_hedge_stat_add(struct json_object *stat_obj, na_env_t *env);
 
 static inline const char *na_bool2str(bool b)
 {
@@ -52,6 +61,7 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
     struct json_object *stat_obj;
     struct json_object *connpoolmap_obj;
     struct json_object *workermap_obj;
+    struct json_object *queuemap_obj;
     time_t up_diff;
     char start_dt[NA_DATETIME_BUF_MAX];
     char up_time[NA_DATETIME_BUF_MAX];
@@ -60,6 +70,7 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
     stat_obj        = json_object_new_object();
     connpoolmap_obj = na_connpoolmap_array_json(connpool);
     workermap_obj   = na_workermap_array_json(env);
+    queuemap_obj    = na_queuemap_array_json(env);
     up_diff         = time(NULL) - StartTimestamp;
 
     na_ts2dt(StartTimestamp, "%Y-%m-%d %H:%M:%S", start_dt, NA_DATETIME_BUF_MAX);
@@ -69,6 +80,7 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
     json_object_object_add(stat_obj, "version",                      json_object_new_string(NA_VERSION));
     json_object_object_add(stat_obj, "environment_name",             json_object_new_string(env->name));
     json_object_object_add(stat_obj, "event_model",                  json_object_new_string(na_event_model_name(env->event_model)));
+    json_object_object_add(stat_obj, "scan_kernel",                  json_object_new_string(na_scan_kernel_name()));
     json_object_object_add(stat_obj, "start_time",                   json_object_new_string(start_dt));
     json_object_object_add(stat_obj, "up_time",                      json_object_new_string(up_time));
     json_object_object_add(stat_obj, "fsport",                       json_object_new_int(env->fsport));
@@ -80,19 +92,38 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
     json_object_object_add(stat_obj, "current_target_host",          json_object_new_string(na_active_host_select(env)));
     json_object_object_add(stat_obj, "current_target_port",          json_object_new_int(na_active_port_select(env)));
     json_object_object_add(stat_obj, "worker_max",                   json_object_new_int(env->worker_max));
+    json_object_object_add(stat_obj, "reuseport",                    json_object_new_string(na_bool2str(env->is_reuseport)));
     json_object_object_add(stat_obj, "conn_max",                     json_object_new_int(env->conn_max));
+    json_object_object_add(stat_obj, "accept_batch_max",             json_object_new_int(env->accept_batch_max));
+    json_object_object_add(stat_obj, "cpu_affinity",                 json_object_new_string(env->cpu_affinity));
+    json_object_object_add(stat_obj, "numa_node",                    json_object_new_int(env->numa_node));
+    json_object_object_add(stat_obj, "persistent_watcher",           json_object_new_string(na_bool2str(env->is_persistent_watcher)));
+    json_object_object_add(stat_obj, "response_streaming",           json_object_new_string(na_bool2str(env->is_response_streaming)));
+    json_object_object_add(stat_obj, "request_streaming",            json_object_new_string(na_bool2str(env->is_request_streaming)));
+    json_object_object_add(stat_obj, "pipelining",                   json_object_new_string(na_bool2str(env->is_pipelining)));
+    json_object_object_add(stat_obj, "upstream_protocol",            json_object_new_string(na_upstream_protocol_name(env->upstream_protocol)));
     json_object_object_add(stat_obj, "connpool_max",                 json_object_new_int(env->connpool_max));
     json_object_object_add(stat_obj, "is_refused_active",            json_object_new_string(na_bool2str(env->is_refused_active)));
+    json_object_object_add(stat_obj, "topology_epoch",               json_object_new_int64(atomic_load(&env->topology_epoch)));
     json_object_object_add(stat_obj, "request_bufsize",              json_object_new_int(env->request_bufsize));
     json_object_object_add(stat_obj, "response_bufsize",             json_object_new_int(env->response_bufsize));
-    json_object_object_add(stat_obj, "current_conn",                 json_object_new_int(env->current_conn));
+    json_object_object_add(stat_obj, "current_conn",                 json_object_new_int(atomic_load(&env->current_conn)));
     json_object_object_add(stat_obj, "available_conn",               json_object_new_int(na_available_conn(connpool)));
-    json_object_object_add(stat_obj, "current_conn_max",             json_object_new_int(env->current_conn_max));
+    json_object_object_add(stat_obj, "current_conn_max",             json_object_new_int(atomic_load(&env->current_conn_max)));
     json_object_object_add(stat_obj, "slow_query_sec",               json_object_new_double((double)((double)env->slow_query_sec.tv_sec +
                                                                                                      (double)env->slow_query_sec.tv_nsec /
                                                                                                      1000000000L)));
     json_object_object_add(stat_obj, "slow_query_log_format",        json_object_new_string(na_log_format_name(env->slow_query_log_format)));
     json_object_object_add(stat_obj, "worker_map",                   workermap_obj);
+    json_object_object_add(stat_obj, "queue_depth_map",              queuemap_obj);
+    na_queue_stat_add(stat_obj, env);
+    na_steal_stat_add(stat_obj, env);
+    na_collapse_stat_add(stat_obj, env);
+    na_batch_stat_add(stat_obj, env);
+    na_noreply_stat_add(stat_obj, env);
+    na_target_servers_stat_add(stat_obj, env);
+    na_fanout_stat_add(stat_obj, env);
+    na_hedge_stat_add(stat_obj, env);
     json_object_object_add(stat_obj, "connpool_map",                 connpoolmap_obj);
 
     snprintf(buf, bufsize, "%s", json_object_to_json_string(stat_obj));
@@ -130,11 +161,200 @@ static struct json_object *na_workermap_array_json(na_env_t *env)
     struct json_object *workermap_obj;
     workermap_obj = json_object_new_array();
     for (int i=0;i<env->worker_max;++i) {
-        json_object_array_add(workermap_obj, json_object_new_boolean(env->is_worker_busy[i]));
+        json_object_array_add(workermap_obj, json_object_new_boolean(na_is_worker_busy(env, i)));
     }
     return workermap_obj;
 }
 
+static struct json_object *na_queuemap_array_json(na_env_t *env)
+{
+    struct json_object *queuemap_obj;
+    queuemap_obj = json_object_new_array();
+    for (int i=0;i<env->worker_max;++i) {
+        json_object_array_add(queuemap_obj, json_object_new_int(na_event_queue_depth(env->workers[i].queue)));
+    }
+    return queuemap_obj;
+}
+
+static void na_queue_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    uint64_t overflow_cnt, pop_cnt, wait_nsec_sum, wait_nsec_max, wait;
+    na_event_queue_t *q;
+
+    overflow_cnt  = 0;
+    pop_cnt       = 0;
+    wait_nsec_sum = 0;
+    wait_nsec_max = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        q              = env->workers[i].queue;
+        overflow_cnt  += atomic_load_explicit(&q->overflow_cnt,  memory_order_relaxed);
+        pop_cnt       += atomic_load_explicit(&q->pop_cnt,       memory_order_relaxed);
+        wait_nsec_sum += atomic_load_explicit(&q->wait_nsec_sum, memory_order_relaxed);
+        wait           = atomic_load_explicit(&q->wait_nsec_max, memory_order_relaxed);
+        if (wait > wait_nsec_max) {
+            wait_nsec_max = wait;
+        }
+    }
+
+    json_object_object_add(stat_obj, "queue_overflow_cnt",  json_object_new_int64(overflow_cnt));
+    json_object_object_add(stat_obj, "queue_pop_cnt",       json_object_new_int64(pop_cnt));
+    json_object_object_add(stat_obj, "queue_wait_avg_usec", json_object_new_double(pop_cnt > 0 ? (double)wait_nsec_sum / pop_cnt / 1000 : 0.0));
+    json_object_object_add(stat_obj, "queue_wait_max_usec", json_object_new_double((double)wait_nsec_max / 1000));
+}
+
+static void na_steal_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    struct json_object *loadmap_obj;
+    struct json_object *stealmap_obj;
+    uint64_t steal_cnt, donate_cnt, cnt;
+    na_event_worker_t *worker;
+
+    loadmap_obj  = json_object_new_array();
+    stealmap_obj = json_object_new_array();
+    steal_cnt    = 0;
+    donate_cnt   = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        worker      = &env->workers[i];
+        cnt         = atomic_load_explicit(&worker->steal_cnt, memory_order_relaxed);
+        steal_cnt  += cnt;
+        donate_cnt += atomic_load_explicit(&worker->donate_cnt, memory_order_relaxed);
+        json_object_array_add(loadmap_obj,  json_object_new_int(atomic_load_explicit(&worker->load, memory_order_relaxed)));
+        json_object_array_add(stealmap_obj, json_object_new_int64(cnt));
+    }
+
+    json_object_object_add(stat_obj, "work_stealing",  json_object_new_string(na_bool2str(env->is_work_stealing)));
+    json_object_object_add(stat_obj, "worker_load_map", loadmap_obj);
+    json_object_object_add(stat_obj, "steal_map",       stealmap_obj);
+    json_object_object_add(stat_obj, "steal_cnt",       json_object_new_int64(steal_cnt));
+    json_object_object_add(stat_obj, "donate_cnt",      json_object_new_int64(donate_cnt));
+}
+
+static void na_collapse_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    uint64_t collapse_cnt, collapse_fetch_cnt;
+
+    collapse_cnt       = 0;
+    collapse_fetch_cnt = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        collapse_cnt       += atomic_load_explicit(&env->workers[i].collapse_cnt,       memory_order_relaxed);
+        collapse_fetch_cnt += atomic_load_explicit(&env->workers[i].collapse_fetch_cnt, memory_order_relaxed);
+    }
+
+    json_object_object_add(stat_obj, "request_collapsing", json_object_new_string(na_bool2str(env->is_request_collapsing)));
+    json_object_object_add(stat_obj, "collapse_cnt",       json_object_new_int64(collapse_cnt));
+    json_object_object_add(stat_obj, "collapse_fetch_cnt", json_object_new_int64(collapse_fetch_cnt));
+}
+
+static void na_batch_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    struct json_object *hist_obj;
+    uint64_t hist[NA_BATCH_HIST_MAX];
+
+    memset(hist, 0, sizeof(hist));
+
+    for (int i=0;i<env->worker_max;++i) {
+        for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+            hist[j] += atomic_load_explicit(&env->workers[i].batch_hist[j], memory_order_relaxed);
+        }
+    }
+
+    hist_obj = json_object_new_array();
+    for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+        json_object_array_add(hist_obj, json_object_new_int64(hist[j]));
+    }
+
+    json_object_object_add(stat_obj, "batch_window_usec", json_object_new_int(env->batch_window_usec));
+    json_object_object_add(stat_obj, "batch_key_max",     json_object_new_int(env->batch_key_max));
+    json_object_object_add(stat_obj, "batch_size_hist",   hist_obj);
+}
+
+static void na_noreply_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    uint64_t noreply_cnt, noreply_error_cnt;
+
+    noreply_cnt       = 0;
+    noreply_error_cnt = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        noreply_cnt       += atomic_load_explicit(&env->workers[i].noreply_cnt,       memory_order_relaxed);
+        noreply_error_cnt += atomic_load_explicit(&env->workers[i].noreply_error_cnt, memory_order_relaxed);
+    }
+
+    json_object_object_add(stat_obj, "noreply_cnt",       json_object_new_int64(noreply_cnt));
+    json_object_object_add(stat_obj, "noreply_error_cnt", json_object_new_int64(noreply_error_cnt));
+}
+
+static void na_target_servers_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    na_server_t *server;
+    na_connpool_t *connpool;
+    struct json_object *servers_obj;
+    struct json_object *server_obj;
+
+    servers_obj = json_object_new_array();
+    for (int i=0;i<env->target_server_cnt;++i) {
+        server     = &env->target_servers[i];
+        connpool   = na_connpool_node(env, i);
+        server_obj = json_object_new_object();
+        json_object_object_add(server_obj, "host",           json_object_new_string(server->host.ipaddr));
+        json_object_object_add(server_obj, "port",           json_object_new_int(server->host.port));
+        json_object_object_add(server_obj, "weight",         json_object_new_int(server->weight));
+        json_object_object_add(server_obj, "available_conn", json_object_new_int(na_available_conn(connpool)));
+        json_object_object_add(server_obj, "inflight",       json_object_new_int(atomic_load_explicit(&connpool->inflight, memory_order_relaxed)));
+        json_object_object_add(server_obj, "ewma_usec",      json_object_new_int64(atomic_load_explicit(&connpool->ewma_usec, memory_order_relaxed)));
+        json_object_array_add(servers_obj, server_obj);
+    }
+
+    json_object_object_add(stat_obj, "target_servers",    servers_obj);
+    json_object_object_add(stat_obj, "ketama_points",     json_object_new_int(env->ketama_cnt));
+    json_object_object_add(stat_obj, "replica_balancing", json_object_new_string(na_bool2str(env->is_replica_balancing)));
+}
+
+static void na_fanout_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    struct json_object *hist_obj;
+    uint64_t hist[NA_BATCH_HIST_MAX];
+    uint64_t dedup_cnt;
+
+    memset(hist, 0, sizeof(hist));
+    dedup_cnt = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+            hist[j] += atomic_load_explicit(&env->workers[i].fanout_hist[j], memory_order_relaxed);
+        }
+        dedup_cnt += atomic_load_explicit(&env->workers[i].fanout_dedup_cnt, memory_order_relaxed);
+    }
+
+    hist_obj = json_object_new_array();
+    for (int j=0;j<NA_BATCH_HIST_MAX;++j) {
+        json_object_array_add(hist_obj, json_object_new_int64(hist[j]));
+    }
+
+    json_object_object_add(stat_obj, "fanout_width_hist", hist_obj);
+    json_object_object_add(stat_obj, "fanout_dedup_cnt",  json_object_new_int64(dedup_cnt));
+}
+
+static void na_hedge_stat_add(struct json_object *stat_obj, na_env_t *env)
+{
+    uint64_t hedge_cnt, hedge_win_cnt;
+
+    hedge_cnt     = 0;
+    hedge_win_cnt = 0;
+
+    for (int i=0;i<env->worker_max;++i) {
+        hedge_cnt     += atomic_load_explicit(&env->workers[i].hedge_cnt,     memory_order_relaxed);
+        hedge_win_cnt += atomic_load_explicit(&env->workers[i].hedge_win_cnt, memory_order_relaxed);
+    }
+
+    json_object_object_add(stat_obj, "hedge_delay_usec", json_object_new_int(env->hedge_delay_usec));
+    json_object_object_add(stat_obj, "hedge_cnt",        json_object_new_int64(hedge_cnt));
+    json_object_object_add(stat_obj, "hedge_win_cnt",    json_object_new_int64(hedge_win_cnt));
+}
+
 void na_stat_callback (EV_P_ struct ev_io *w, int revents)
 {
     int cfd, stfd, th_ret;
@@ -0,0 +1,132 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "defines.h"
+
+/**
+ * The upstream topology is an immutable snapshot published by
+ * the health check. Event threads read it with a single atomic load.
+ *
+ * Each reader announces the epoch it entered with while it is
+ * running callbacks, and 0 while it is polling. A retired snapshot is
+ * freed once every reader is polling or has entered a later epoch.
+ */
+
+// private functions
+static uint64_t na_topology_reader_min (na_env_t *env);
+
+static uint64_t na_topology_reader_min (na_env_t *env)
+{
+    uint64_t min, epoch;
+
+    min = UINT64_MAX;
+
+    for (int i=0;i<env->worker_max;++i) {
+        epoch = atomic_load(&env->workers[i].topology_epoch);
+        if (epoch != 0 && epoch < min) {
+            min = epoch;
+        }
+    }
+
+    epoch = atomic_load(&env->acceptor_epoch);
+    if (epoch != 0 && epoch < min) {
+        min = epoch;
+    }
+
+    return min;
+}
+
+void na_topology_init (na_env_t *env)
+{
+    atomic_init(&env->topology,       NULL);
+    atomic_init(&env->topology_epoch, 0);
+    atomic_init(&env->acceptor_epoch, 0);
+    env->topology_retired = NULL;
+    na_topology_publish(env, false);
+}
+
+void na_topology_publish (na_env_t *env, bool is_refused_accept)
+{
+    na_topology_t *topology, *old;
+
+    topology = (na_topology_t *)malloc(sizeof(na_topology_t));
+    if (topology == NULL) {
+        NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+    }
+
+    old = atomic_load(&env->topology);
+
+    topology->epoch             = old != NULL ? old->epoch + 1 : 1;
+    topology->is_refused_active = env->is_refused_active;
+    topology->is_refused_accept = is_refused_accept;
+    topology->connpool          = na_connpool_select(env);
+    if (env->is_use_backup && env->is_refused_active) {
+        topology->server = &env->backup_server;
+    } else {
+        topology->server = &env->target_server;
+    }
+    topology->next = NULL;
+
+    atomic_store(&env->topology,       topology);
+    atomic_store(&env->topology_epoch, topology->epoch);
+
+    if (old != NULL) {
+        old->next             = env->topology_retired;
+        env->topology_retired = old;
+    }
+}
+
+void na_topology_reclaim (na_env_t *env)
+{
+    na_topology_t **p, *topology;
+    uint64_t min;
+
+    min = na_topology_reader_min(env);
+
+    p = &env->topology_retired;
+    while (*p != NULL) {
+        topology = *p;
+        if (topology->epoch < min) {
+            *p = topology->next;
+            free(topology);
+        } else {
+            p = &topology->next;
+        }
+    }
+}
+
+void na_topology_destroy (na_env_t *env)
+{
+    na_topology_t *topology, *next;
+
+    for (topology=env->topology_retired;topology!=NULL;topology=next) {
+        next = topology->next;
+        free(topology);
+    }
+    env->topology_retired = NULL;
+
+    topology = atomic_exchange(&env->topology, NULL);
+    NA_FREE(topology);
+}
+
+na_topology_t *na_topology_current (na_env_t *env)
+{
+    return atomic_load_explicit(&env->topology, memory_order_acquire);
+}
+
+void na_topology_reader_online (na_env_t *env, _Atomic uint64_t *epoch)
+{
+    atomic_store(epoch, atomic_load(&env->topology_epoch));
+}
+
+void na_topology_reader_offline (_Atomic uint64_t *epoch)
+{
+    atomic_store_explicit(epoch, 0, memory_order_release);
+}
@@ -0,0 +1,565 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+/**
+ * translation of text requests into the upstream protocol(meta or binary)
+ * and of their responses back into text.
+ *
+ * every key of get and every other command becomes exactly one upstream
+ * request without the quiet mode, so upstream responses are counted and
+ * matched in order. the text requests are kept in crbuf until the response
+ * is translated, so nothing but the count is remembered between them.
+ */
+
+static const int NA_TRANSLATE_BUFSIZE_MIN  = 1024;
+static const int NA_TRANSLATE_LINE_MAX     = 512;
+
+static const unsigned char NA_TRANSLATE_BIN_MAGIC_REQUEST = 0x80;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_SET    = 0x01;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_ADD    = 0x02;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_DELETE = 0x04;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_INCR   = 0x05;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_DECR   = 0x06;
+static const unsigned char NA_TRANSLATE_BIN_OPCODE_GETK   = 0x0c;
+
+typedef enum na_translate_bin_status_t {
+    NA_TRANSLATE_BIN_STATUS_OK          = 0x0000,
+    NA_TRANSLATE_BIN_STATUS_NOT_FOUND   = 0x0001,
+    NA_TRANSLATE_BIN_STATUS_EXISTS      = 0x0002,
+    NA_TRANSLATE_BIN_STATUS_TOO_LARGE   = 0x0003,
+    NA_TRANSLATE_BIN_STATUS_NOT_STORED  = 0x0005,
+    NA_TRANSLATE_BIN_STATUS_NON_NUMERIC = 0x0006,
+    NA_TRANSLATE_BIN_STATUS_NO_MEMORY   = 0x0082,
+} na_translate_bin_status_t;
+
+/**
+ * an upstream response.
+ */
+typedef struct na_translate_res_t {
+    const char *line;   // meta: response line without CRLF
+    int linelen;
+    int status;         // binary: status
+    const char *extras; // binary: extras
+    int extlen;
+    uint64_t cas;       // binary: cas
+    const char *data;   // value
+    int datalen;
+} na_translate_res_t;
+
+// private functions
+static bool na_translate_append (na_client_t *client, const void *data, int size);
+static bool na_translate_appendf (na_client_t *client, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+static const char *na_translate_token (const char **p, const char *end, int *len);
+static uint32_t na_translate_be32 (const unsigned char *p);
+static uint64_t na_translate_be64 (const unsigned char *p);
+static void na_translate_put_be32 (unsigned char *p, uint32_t v);
+static void na_translate_put_be64 (unsigned char *p, uint64_t v);
+static bool na_translate_bin_request (na_client_t *client, int opcode, const char *key, int keylen,
+                                      const unsigned char *extras, int extlen, const char *value, int vallen);
+static bool na_translate_res_next (na_upstream_protocol_t protocol, const char **p, const char *end, na_translate_res_t *res);
+static bool na_translate_value (na_client_t *client, na_upstream_protocol_t protocol, na_translate_res_t *res,
+                                const char *key, int keylen, bool is_cas);
+static const char *na_translate_status (na_upstream_protocol_t protocol, na_memproto_cmd_t cmd, na_translate_res_t *res);
+
+static bool na_translate_append (na_client_t *client, const void *data, int size)
+{
+    int es;
+    char *buf;
+
+    if (size == 0) {
+        return true;
+    }
+
+    if (client->twbufsize + size > client->translate_bufsize) {
+        es = client->translate_bufsize > 0 ? client->translate_bufsize : NA_TRANSLATE_BUFSIZE_MIN;
+        while (es < client->twbufsize + size) {
+            es *= 2;
+        }
+        buf = (char *)realloc(client->twbuf, es + 1);
+        if (buf == NULL) {
+            return false;
+        }
+        client->twbuf             = buf;
+        client->translate_bufsize = es;
+    }
+
+    memcpy(client->twbuf + client->twbufsize, data, size);
+    client->twbufsize += size;
+
+    return true;
+}
+
+static bool na_translate_appendf (na_client_t *client, const char *fmt, ...)
+{
+    char line[NA_TRANSLATE_LINE_MAX];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || len >= sizeof(line)) {
+        return false;
+    }
+
+    return na_translate_append(client, line, len);
+}
+
+/**
+ * the next token separated by spaces or NULL.
+ */
+static const char *na_translate_token (const char **p, const char *end, int *len)
+{
+    const char *tok;
+
+    while (*p < end && **p == ' ') {
+        ++*p;
+    }
+    if (*p == end) {
+        return NULL;
+    }
+
+    tok = *p;
+    while (*p < end && **p != ' ') {
+        ++*p;
+    }
+    *len = *p - tok;
+
+    return tok;
+}
+
+static uint32_t na_translate_be32 (const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t na_translate_be64 (const unsigned char *p)
+{
+    return ((uint64_t)na_translate_be32(p) << 32) | na_translate_be32(p + 4);
+}
+
+static void na_translate_put_be32 (unsigned char *p, uint32_t v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8)  & 0xff;
+    p[3] = v         & 0xff;
+}
+
+static void na_translate_put_be64 (unsigned char *p, uint64_t v)
+{
+    na_translate_put_be32(p,     v >> 32);
+    na_translate_put_be32(p + 4, v & 0xffffffff);
+}
+
+static bool na_translate_bin_request (na_client_t *client, int opcode, const char *key, int keylen,
+                                      const unsigned char *extras, int extlen, const char *value, int vallen)
+{
+    unsigned char header[NA_MEMPROTO_BIN_HEADER_SIZE];
+
+    memset(header, 0, sizeof(header));
+    header[0] = NA_TRANSLATE_BIN_MAGIC_REQUEST;
+    header[1] = opcode;
+    header[2] = (keylen >> 8) & 0xff;
+    header[3] = keylen & 0xff;
+    header[4] = extlen;
+    na_translate_put_be32(header + 8, extlen + keylen + vallen);
+
+    return na_translate_append(client, header, sizeof(header)) &&
+           na_translate_append(client, extras, extlen)         &&
+           na_translate_append(client, key, keylen)            &&
+           na_translate_append(client, value, vallen);
+}
+
+/**
+ * translate the framed text requests in crbuf into twbuf.
+ * returns the number of upstream requests or -1 when requests can not be translated.
+ */
+int na_translate_request (na_client_t *client, na_upstream_protocol_t protocol)
+{
+    const char *p, *end, *nl, *cur, *lend, *key, *tok;
+    int keylen, len, cnt;
+    long size;
+    unsigned long flags;
+    long exptime, bytes;
+    unsigned long long delta;
+    unsigned char extras[20];
+    na_memproto_cmd_t cmd;
+
+    client->twbufsize = 0;
+    cnt               = 0;
+    p                 = client->crbuf;
+    end               = client->crbuf + client->crframed;
+    while (p < end) {
+        nl = na_scan_byte(p, end - p, '\n');
+        if (nl == NULL) {
+            return -1;
+        }
+        lend = nl - 1;
+        cur  = p;
+        size = nl - p + 1;
+        cmd  = na_memproto_detect_command((char *)p);
+        len  = 0;
+        tok  = na_translate_token(&cur, lend, &len); // command
+
+        switch (cmd) {
+        case NA_MEMPROTO_CMD_GET:
+            while ((key = na_translate_token(&cur, lend, &keylen)) != NULL) {
+                if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+                    if (!na_translate_bin_request(client, NA_TRANSLATE_BIN_OPCODE_GETK, key, keylen, NULL, 0, NULL, 0)) {
+                        return -1;
+                    }
+                } else if (!na_translate_appendf(client, "mg %.*s s f v%s\r\n", keylen, key, len == 4 ? " c" : "")) {
+                    return -1;
+                }
+                ++cnt;
+            }
+            break;
+        case NA_MEMPROTO_CMD_SET:
+        case NA_MEMPROTO_CMD_ADD:
+            size = na_memproto_storage_request_size(p, end - p);
+            if (size <= 0 || size > end - p) {
+                return -1;
+            }
+            key = na_translate_token(&cur, lend, &keylen);
+            if (key == NULL ||
+                (tok = na_translate_token(&cur, lend, &len)) == NULL) {
+                return -1;
+            }
+            flags = strtoul(tok, NULL, 10);
+            if ((tok = na_translate_token(&cur, lend, &len)) == NULL) {
+                return -1;
+            }
+            exptime = strtol(tok, NULL, 10);
+            bytes   = size - (nl - p + 1) - 2;
+            if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+                na_translate_put_be32(extras,     flags);
+                na_translate_put_be32(extras + 4, (uint32_t)exptime);
+                if (!na_translate_bin_request(client,
+                                              cmd == NA_MEMPROTO_CMD_SET ? NA_TRANSLATE_BIN_OPCODE_SET : NA_TRANSLATE_BIN_OPCODE_ADD,
+                                              key, keylen, extras, 8, nl + 1, bytes))
+                {
+                    return -1;
+                }
+            } else if (!na_translate_appendf(client, "ms %.*s %ld F%lu T%ld%s\r\n",
+                                             keylen, key, bytes, flags, exptime,
+                                             cmd == NA_MEMPROTO_CMD_ADD ? " ME" : "") ||
+                       !na_translate_append(client, nl + 1, bytes + 2))
+            {
+                return -1;
+            }
+            ++cnt;
+            break;
+        case NA_MEMPROTO_CMD_DELETE:
+            if ((key = na_translate_token(&cur, lend, &keylen)) == NULL) {
+                return -1;
+            }
+            if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+                if (!na_translate_bin_request(client, NA_TRANSLATE_BIN_OPCODE_DELETE, key, keylen, NULL, 0, NULL, 0)) {
+                    return -1;
+                }
+            } else if (!na_translate_appendf(client, "md %.*s\r\n", keylen, key)) {
+                return -1;
+            }
+            ++cnt;
+            break;
+        case NA_MEMPROTO_CMD_INCR:
+        case NA_MEMPROTO_CMD_DECR:
+            if ((key = na_translate_token(&cur, lend, &keylen)) == NULL ||
+                (tok = na_translate_token(&cur, lend, &len)) == NULL)
+            {
+                return -1;
+            }
+            delta = strtoull(tok, NULL, 10);
+            if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+                // the initial value is not used because the expiration is 0xffffffff
+                na_translate_put_be64(extras,      delta);
+                na_translate_put_be64(extras + 8,  0);
+                na_translate_put_be32(extras + 16, 0xffffffff);
+                if (!na_translate_bin_request(client,
+                                              cmd == NA_MEMPROTO_CMD_INCR ? NA_TRANSLATE_BIN_OPCODE_INCR : NA_TRANSLATE_BIN_OPCODE_DECR,
+                                              key, keylen, extras, 20, NULL, 0))
+                {
+                    return -1;
+                }
+            } else if (!na_translate_appendf(client, "ma %.*s D%llu%s v\r\n", keylen, key, delta,
+                                             cmd == NA_MEMPROTO_CMD_DECR ? " MD" : ""))
+            {
+                return -1;
+            }
+            ++cnt;
+            break;
+        default:
+            return -1;
+        }
+
+        p += size;
+    }
+
+    return cnt > 0 ? cnt : -1;
+}
+
+/**
+ * read an upstream response at *p and advance *p after it.
+ */
+static bool na_translate_res_next (na_upstream_protocol_t protocol, const char **p, const char *end, na_translate_res_t *res)
+{
+    const unsigned char *h;
+    const char *nl, *s;
+    uint32_t bodylen;
+    int keylen;
+    uint64_t size;
+
+    memset(res, 0, sizeof(*res));
+
+    if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+        if (end - *p < NA_MEMPROTO_BIN_HEADER_SIZE) {
+            return false;
+        }
+        h       = (const unsigned char *)*p;
+        keylen  = (h[2] << 8) | h[3];
+        bodylen = na_translate_be32(h + 8);
+        if (bodylen > end - *p - NA_MEMPROTO_BIN_HEADER_SIZE || h[4] + keylen > bodylen) {
+            return false;
+        }
+        res->status  = (h[6] << 8) | h[7];
+        res->cas     = na_translate_be64(h + 16);
+        res->extras  = *p + NA_MEMPROTO_BIN_HEADER_SIZE;
+        res->extlen  = h[4];
+        res->data    = res->extras + res->extlen + keylen;
+        res->datalen = bodylen - res->extlen - keylen;
+        *p          += NA_MEMPROTO_BIN_HEADER_SIZE + bodylen;
+        return true;
+    }
+
+    nl = na_scan_byte(*p, end - *p, '\n');
+    if (nl == NULL || nl == *p || nl[-1] != '\r') {
+        return false;
+    }
+    res->line    = *p;
+    res->linelen = nl - 1 - *p;
+    *p           = nl + 1;
+
+    if (res->linelen >= 3 && memcmp(res->line, "VA ", 3) == 0) {
+        s    = res->line + 3;
+        size = strtoull(s, NULL, 10);
+        if (end - *p < 2 || size > (uint64_t)(end - *p - 2)) {
+            return false;
+        }
+        res->data    = *p;
+        res->datalen = size;
+        *p          += size + 2;
+    }
+
+    return true;
+}
+
+/**
+ * a value of get in text.
+ *
+ *   VALUE <key> <flags> <bytes> [<cas unique>]\r\n<data>\r\n
+ */
+static bool na_translate_value (na_client_t *client, na_upstream_protocol_t protocol, na_translate_res_t *res,
+                                const char *key, int keylen, bool is_cas)
+{
+    const char *cur, *lend, *tok;
+    unsigned long flags;
+    unsigned long long cas;
+    int len;
+
+    flags = 0;
+    cas   = 0;
+    if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+        if (res->status != NA_TRANSLATE_BIN_STATUS_OK) {
+            return true; // miss
+        }
+        if (res->extlen >= 4) {
+            flags = na_translate_be32((const unsigned char *)res->extras);
+        }
+        cas = res->cas;
+    } else {
+        if (res->data == NULL) {
+            return true; // EN or an error
+        }
+        // return flags are s<size> f<flags> v [c<cas>]
+        cur  = res->line + 3;
+        lend = res->line + res->linelen;
+        na_translate_token(&cur, lend, &len); // size
+        while ((tok = na_translate_token(&cur, lend, &len)) != NULL) {
+            if (*tok == 'f') {
+                flags = strtoul(tok + 1, NULL, 10);
+            } else if (*tok == 'c') {
+                cas = strtoull(tok + 1, NULL, 10);
+            }
+        }
+    }
+
+    if (is_cas) {
+        if (!na_translate_appendf(client, "VALUE %.*s %lu %d %llu\r\n", keylen, key, flags, res->datalen, cas)) {
+            return false;
+        }
+    } else if (!na_translate_appendf(client, "VALUE %.*s %lu %d\r\n", keylen, key, flags, res->datalen)) {
+        return false;
+    }
+
+    return na_translate_append(client, res->data, res->datalen) &&
+           na_translate_append(client, "\r\n", 2);
+}
+
+/**
+ * the text response line of set, add, delete, incr and decr.
+ * NULL means that the response is the value of incr or decr.
+ */
+static const char *na_translate_status (na_upstream_protocol_t protocol, na_memproto_cmd_t cmd, na_translate_res_t *res)
+{
+    if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+        switch (res->status) {
+        case NA_TRANSLATE_BIN_STATUS_OK:
+            if (cmd == NA_MEMPROTO_CMD_INCR || cmd == NA_MEMPROTO_CMD_DECR) {
+                return NULL;
+            }
+            return cmd == NA_MEMPROTO_CMD_DELETE ? "DELETED" : "STORED";
+        case NA_TRANSLATE_BIN_STATUS_NOT_FOUND:
+            return "NOT_FOUND";
+        case NA_TRANSLATE_BIN_STATUS_EXISTS:
+            return cmd == NA_MEMPROTO_CMD_ADD ? "NOT_STORED" : "EXISTS";
+        case NA_TRANSLATE_BIN_STATUS_NOT_STORED:
+            return "NOT_STORED";
+        case NA_TRANSLATE_BIN_STATUS_NON_NUMERIC:
+            return "CLIENT_ERROR cannot increment or decrement non-numeric value";
+        case NA_TRANSLATE_BIN_STATUS_TOO_LARGE:
+            return "SERVER_ERROR object too large for cache";
+        case NA_TRANSLATE_BIN_STATUS_NO_MEMORY:
+            return "SERVER_ERROR out of memory storing object";
+        default:
+            return "SERVER_ERROR";
+        }
+    }
+
+    if (res->data != NULL) {
+        return NULL; // VA of ma
+    } else if (res->linelen >= 2 && memcmp(res->line, "HD", 2) == 0) {
+        return cmd == NA_MEMPROTO_CMD_DELETE ? "DELETED" : "STORED";
+    } else if (res->linelen >= 2 && memcmp(res->line, "NS", 2) == 0) {
+        return "NOT_STORED";
+    } else if (res->linelen >= 2 && memcmp(res->line, "EX", 2) == 0) {
+        return cmd == NA_MEMPROTO_CMD_ADD ? "NOT_STORED" : "EXISTS";
+    } else if (res->linelen >= 2 && memcmp(res->line, "NF", 2) == 0) {
+        return "NOT_FOUND";
+    }
+
+    return ""; // an error line is passed through
+}
+
+/**
+ * translate the upstream responses in srbuf back into text in order of
+ * the text requests in crbuf. responses of noreply requests are dropped.
+ */
+bool na_translate_response (na_client_t *client, na_upstream_protocol_t protocol)
+{
+    const char *p, *end, *nl, *cur, *lend, *key, *r, *rend, *status;
+    int keylen, len;
+    long size;
+    bool is_noreply;
+    na_memproto_cmd_t cmd;
+    na_translate_res_t res;
+
+    client->twbufsize = 0;
+    p                 = client->crbuf;
+    end               = client->crbuf + client->crframed;
+    r                 = client->srbuf;
+    rend              = client->srbuf + client->srbufsize;
+    while (p < end) {
+        nl = na_scan_byte(p, end - p, '\n');
+        if (nl == NULL) {
+            return false;
+        }
+        lend       = nl - 1;
+        cur        = p;
+        size       = nl - p + 1;
+        cmd        = na_memproto_detect_command((char *)p);
+        is_noreply = lend - p >= 8 && memcmp(lend - 8, " noreply", 8) == 0;
+        len        = 0;
+        na_translate_token(&cur, lend, &len); // command
+
+        if (cmd == NA_MEMPROTO_CMD_GET) {
+            while ((key = na_translate_token(&cur, lend, &keylen)) != NULL) {
+                if (!na_translate_res_next(protocol, &r, rend, &res) ||
+                    !na_translate_value(client, protocol, &res, key, keylen, len == 4))
+                {
+                    return false;
+                }
+            }
+            if (!na_translate_append(client, "END\r\n", 5)) {
+                return false;
+            }
+            p += size;
+            continue;
+        }
+
+        if (cmd == NA_MEMPROTO_CMD_SET || cmd == NA_MEMPROTO_CMD_ADD) {
+            size = na_memproto_storage_request_size(p, end - p);
+            if (size <= 0) {
+                return false;
+            }
+        }
+
+        if (!na_translate_res_next(protocol, &r, rend, &res)) {
+            return false;
+        }
+        p += size;
+
+        if (is_noreply) {
+            continue;
+        }
+
+        status = na_translate_status(protocol, cmd, &res);
+        if (status == NULL) {
+            // the value of incr or decr
+            if (protocol == NA_UPSTREAM_PROTOCOL_BINARY) {
+                if (res.datalen != 8 ||
+                    !na_translate_appendf(client, "%llu\r\n",
+                                          (unsigned long long)na_translate_be64((const unsigned char *)res.data)))
+                {
+                    return false;
+                }
+            } else if (!na_translate_append(client, res.data, res.datalen) ||
+                       !na_translate_append(client, "\r\n", 2))
+            {
+                return false;
+            }
+        } else if (*status == '\0') {
+            if (!na_translate_append(client, res.line, res.linelen) ||
+                !na_translate_append(client, "\r\n", 2))
+            {
+                return false;
+            }
+        } else if (!na_translate_appendf(client, "%s\r\n", status)) {
+            return false;
+        }
+    }
+
+    if (client->twbufsize > client->response_bufsize) {
+        client->srbuf = (char *)realloc(client->srbuf, client->twbufsize + 1);
+        client->response_bufsize = client->twbufsize;
+    }
+    memcpy(client->srbuf, client->twbuf, client->twbufsize);
+    client->srbufsize                = client->twbufsize;
+    client->srbuf[client->srbufsize] = '\0';
+
+    return true;
+}